@@ -0,0 +1,138 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#include "HashScheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace
+{
+  thread_local const HashScheduler* t_scheduler{};
+  thread_local size_t t_worker_index{};
+}
+
+HashScheduler::HashScheduler(unsigned thread_count)
+{
+  if (thread_count == 0)
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+  _workers.reserve(thread_count);
+  for (auto i = 0u; i < thread_count; ++i)
+    _workers.push_back(std::make_unique<Worker>());
+
+  // Start them only after all deques exist, workers steal from each other right away
+  _threads.reserve(thread_count);
+  for (auto i = 0u; i < thread_count; ++i)
+    _threads.emplace_back(&HashScheduler::WorkerMain, this, i);
+}
+
+HashScheduler::~HashScheduler()
+{
+  {
+    std::lock_guard<std::mutex> lock(_sleep_mutex);
+    _stop = true;
+  }
+  _sleep_cv.notify_all();
+  for (auto& thread : _threads)
+    thread.join();
+}
+
+size_t HashScheduler::CurrentWorker() const
+{
+  return t_scheduler == this ? t_worker_index : SIZE_MAX;
+}
+
+void HashScheduler::Submit(const Job* jobs, size_t count)
+{
+  if (count == 0)
+    return;
+
+  const auto self = CurrentWorker();
+  const auto index = self != SIZE_MAX ? self : _next_worker++ % _workers.size();
+
+  _pending += static_cast<ptrdiff_t>(count);
+
+  {
+    auto& worker = *_workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.jobs.insert(worker.jobs.end(), jobs, jobs + count);
+  }
+
+  auto wake = self != SIZE_MAX ? count - 1 : count;
+  {
+    std::lock_guard<std::mutex> lock(_sleep_mutex);
+    wake = std::min<size_t>(wake, _sleeping);
+  }
+  for (auto i = 0u; i < wake; ++i)
+    _sleep_cv.notify_one();
+}
+
+bool HashScheduler::TryPop(size_t index, Job& job)
+{
+  // Own deque from the back, it's what we submitted last and likely still hot
+  {
+    auto& worker = *_workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (!worker.jobs.empty())
+    {
+      job = worker.jobs.back();
+      worker.jobs.pop_back();
+      return true;
+    }
+  }
+
+  // Others from the front, oldest first
+  const auto count = _workers.size();
+  for (auto i = 1u; i < count; ++i)
+  {
+    auto& victim = *_workers[(index + i) % count];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.jobs.empty())
+    {
+      job = victim.jobs.front();
+      victim.jobs.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void HashScheduler::WorkerMain(size_t index)
+{
+  t_scheduler = this;
+  t_worker_index = index;
+
+  while (true)
+  {
+    Job job;
+    if (TryPop(index, job))
+    {
+      --_pending;
+      job.fn(job.ctx, job.arg);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_sleep_mutex);
+    if (_pending > 0)
+      continue; // Being pushed right now, or sitting in a deque we already looked at
+    if (_stop)
+      return;
+    ++_sleeping;
+    _sleep_cv.wait(lock, [this] { return _pending > 0 || _stop; });
+    --_sleeping;
+  }
+}
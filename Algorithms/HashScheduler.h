@@ -0,0 +1,83 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for hash jobs. Every worker owns a deque: jobs submitted from a worker go to its own
+// deque, everything else is spread round robin, and a worker that runs dry steals from the others. Only plain
+// standard library, so it runs anywhere the rest of the hashing core does.
+class HashScheduler
+{
+public:
+  using JobFn = void(void* ctx, size_t arg);
+
+  struct Job
+  {
+    JobFn* fn;
+    void* ctx;
+    size_t arg;
+  };
+
+  // thread_count of 0 means one per hardware thread
+  explicit HashScheduler(unsigned thread_count);
+
+  // Waits for the workers to run out of jobs and exit
+  ~HashScheduler();
+
+  HashScheduler(const HashScheduler&) = delete;
+  HashScheduler(HashScheduler&&) = delete;
+  HashScheduler& operator=(const HashScheduler&) = delete;
+  HashScheduler& operator=(HashScheduler&&) = delete;
+
+  // Wakes at most as many sleeping workers as there are jobs. When called from a worker one of the jobs is left for
+  // the caller itself, it'll pick it up as soon as it returns from the current one.
+  void Submit(const Job* jobs, size_t count);
+
+  unsigned GetThreadCount() const { return static_cast<unsigned>(_threads.size()); }
+
+private:
+  struct Worker
+  {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+  };
+
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::vector<std::thread> _threads;
+
+  // Jobs submitted but not taken yet. Raised before the jobs are pushed so a worker never sleeps on a queued job.
+  std::atomic<ptrdiff_t> _pending{};
+  std::atomic<unsigned> _next_worker{};
+
+  std::mutex _sleep_mutex;
+  std::condition_variable _sleep_cv;
+  unsigned _sleeping{};
+  bool _stop{};
+
+  void WorkerMain(size_t index);
+
+  bool TryPop(size_t index, Job& job);
+
+  // Index of the calling thread's worker, or SIZE_MAX if it isn't one of ours
+  size_t CurrentWorker() const;
+};
@@ -15,6 +15,11 @@
 //    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
 #include "Hasher.h"
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <mbedtls/md.h>
 #include <mbedtls/md2.h>
 #include <mbedtls/md4.h>
@@ -27,6 +32,14 @@
 #include "sha3.h"
 #include "crc32.h"
 #include "blake3.h"
+#include "sha_accel.h"
+
+// SHA-1 and SHA-256 share the block function signature, so one pointer type covers both
+using BlocksFn = sha256_blocks_fn;
+
+// Picked once at startup, null when the CPU has nothing better than mbedTLS' generic code
+static BlocksFn* const s_sha1_blocks = sha1_get_blocks_fn();
+static BlocksFn* const s_sha256_blocks = sha256_get_blocks_fn();
 
 template <
   typename Ctx,
@@ -35,7 +48,9 @@ template <
   int (*StartsRet)(Ctx* ctx),
   void (*Free)(Ctx* ctx),
   int (*UpdateRet)(Ctx* ctx, const unsigned char*, size_t),
-  int (*FinishRet)(Ctx* ctx, unsigned char*)
+  int (*FinishRet)(Ctx* ctx, unsigned char*),
+  BlocksFn* const* Blocks = nullptr,
+  bool RawState = Blocks != nullptr
 >
 class MbedHashContext : HashContext
 {
@@ -43,6 +58,14 @@ class MbedHashContext : HashContext
 
   Ctx ctx{};
 
+  void AddTotal(uint64_t bytes)
+  {
+    // total is a 64 bit byte counter split into two halves
+    const auto total = ((uint64_t)ctx.total[1] << 32 | ctx.total[0]) + bytes;
+    ctx.total[0] = (uint32_t)total;
+    ctx.total[1] = (uint32_t)(total >> 32);
+  }
+
 public:
   MbedHashContext(const HashAlgorithm* algorithm) : HashContext(algorithm)
   {
@@ -63,12 +86,66 @@ public:
 
   void Update(const void* data, size_t size) override
   {
+    if constexpr (Blocks != nullptr)
+    {
+      if (const auto blocks_fn = *Blocks)
+      {
+        // Let mbedTLS do the buffering and padding, we only take over the whole blocks in between. This way
+        // the context never holds anything mbedTLS wouldn't, and the result is the same by construction.
+        auto p = (const unsigned char*)data;
+        const auto buffered = ctx.total[0] & 0x3F;
+        if (buffered)
+        {
+          const auto fill = std::min<size_t>(64 - buffered, size);
+          UpdateRet(&ctx, p, fill);
+          p += fill;
+          size -= fill;
+        }
+        const auto blocks = size / 64;
+        if (blocks)
+        {
+          blocks_fn(ctx.state, p, blocks);
+          const auto bytes = blocks * 64;
+          AddTotal(bytes);
+          p += bytes;
+          size -= bytes;
+        }
+        if (size)
+          UpdateRet(&ctx, p, size);
+        return;
+      }
+    }
     UpdateRet(&ctx, (const unsigned char*)data, size);
   }
 
-  std::vector<uint8_t> Finish() override
+  uint32_t* GetRawState() override
+  {
+    if constexpr (RawState)
+      return ctx.state;
+    else
+      return nullptr;
+  }
+
+  size_t GetBufferedSize() const override
   {
-    std::vector<uint8_t> result;
+    if constexpr (RawState)
+      return ctx.total[0] & 0x3F;
+    else
+      return 0;
+  }
+
+  void AddRawBlocks(size_t count) override
+  {
+    if constexpr (RawState)
+      AddTotal((uint64_t)count * 64);
+    else
+      (void)count;
+  }
+
+  HashDigest Finish() override
+  {
+    static_assert(MBEDTLS_MD_MAX_SIZE <= HashDigest::k_capacity);
+    HashDigest result;
     // mbedTLS says this should be 32 for SHA224 so we can't just use Size
     result.resize(MBEDTLS_MD_MAX_SIZE);
     FinishRet(&ctx, result.data());
@@ -95,9 +172,28 @@ int sha512_starts_ret_binder(mbedtls_sha512_context* ctx) { return mbedtls_sha51
 
 using Md2HashContext = MBED_HASH_CONTEXT_TYPE(md2, 16);
 using Md4HashContext = MBED_HASH_CONTEXT_TYPE(md4, 16);
-using Md5HashContext = MBED_HASH_CONTEXT_TYPE(md5, 16);
+using Md5HashContext = MbedHashContext<
+  mbedtls_md5_context,
+  16,
+  &mbedtls_md5_init,
+  &mbedtls_md5_starts_ret,
+  &mbedtls_md5_free,
+  &mbedtls_md5_update_ret,
+  &mbedtls_md5_finish_ret,
+  nullptr,
+  true
+>;
 using RipeMD160HashContext = MBED_HASH_CONTEXT_TYPE(ripemd160, 20);
-using Sha1HashContext = MBED_HASH_CONTEXT_TYPE(sha1, 20);
+using Sha1HashContext = MbedHashContext<
+  mbedtls_sha1_context,
+  20,
+  &mbedtls_sha1_init,
+  &mbedtls_sha1_starts_ret,
+  &mbedtls_sha1_free,
+  &mbedtls_sha1_update_ret,
+  &mbedtls_sha1_finish_ret,
+  &s_sha1_blocks
+>;
 using Sha224HashContext = MbedHashContext<
   mbedtls_sha256_context,
   28,
@@ -105,7 +201,8 @@ using Sha224HashContext = MbedHashContext<
   &sha256_starts_ret_binder<true>,
   &mbedtls_sha256_free,
   &mbedtls_sha256_update_ret,
-  &mbedtls_sha256_finish_ret
+  &mbedtls_sha256_finish_ret,
+  &s_sha256_blocks
 >;
 using Sha256HashContext = MbedHashContext<
   mbedtls_sha256_context,
@@ -114,7 +211,8 @@ using Sha256HashContext = MbedHashContext<
   &sha256_starts_ret_binder<false>,
   &mbedtls_sha256_free,
   &mbedtls_sha256_update_ret,
-  &mbedtls_sha256_finish_ret
+  &mbedtls_sha256_finish_ret,
+  &s_sha256_blocks
 >;
 using Sha384HashContext = MbedHashContext<
   mbedtls_sha512_context,
@@ -158,9 +256,9 @@ public:
     Blake2sp_Update(&ctx, (const unsigned char*)data, size);
   }
 
-  std::vector<uint8_t> Finish() override
+  HashDigest Finish() override
   {
-    std::vector<uint8_t> result;
+    HashDigest result;
     result.resize(BLAKE2S_DIGEST_SIZE);
     Blake2sp_Final(&ctx, result.data());
     return result;
@@ -191,11 +289,10 @@ public:
     sha3_Update(&ctx, data, size);
   }
 
-  std::vector<uint8_t> Finish() override
+  HashDigest Finish() override
   {
     const auto begin = (const uint8_t*)sha3_Finalize(&ctx);
-    std::vector<uint8_t> result{ begin, begin + Size };
-    return result;
+    return { begin, Size };
   }
 };
 
@@ -224,9 +321,15 @@ public:
     crc = Crc32_ComputeBuf(crc, data, size);
   }
 
-  std::vector<uint8_t> Finish() override
+  bool UpdateZeros(uint64_t count) override
   {
-    std::vector<uint8_t> result;
+    crc = Crc32_ComputeZeros(crc, count);
+    return true;
+  }
+
+  HashDigest Finish() override
+  {
+    HashDigest result;
     result.resize(4);
     result[0] = 0xFF & (crc >> 24);
     result[1] = 0xFF & (crc >> 16);
@@ -241,6 +344,7 @@ class Blake3HashContext : HashContext
   template <typename T> friend HashContext* hash_context_factory(const HashAlgorithm* algorithm);
 
   blake3_hasher ctx{};
+  ParallelJoinFn* join{};
 
 public:
   Blake3HashContext(const HashAlgorithm* algorithm) : HashContext(algorithm)
@@ -256,12 +360,20 @@ public:
 
   void Update(const void* data, size_t size) override
   {
-    blake3_hasher_update(&ctx, data, size);
+    if (join)
+      blake3_hasher_update_join(&ctx, data, size, join);
+    else
+      blake3_hasher_update(&ctx, data, size);
   }
 
-  std::vector<uint8_t> Finish() override
+  void SetParallelJoin(ParallelJoinFn* fn) override
   {
-    std::vector<uint8_t> result;
+    join = fn;
+  }
+
+  HashDigest Finish() override
+  {
+    HashDigest result;
     result.resize(BLAKE3_OUT_LEN);
     blake3_hasher_finalize(&ctx, result.data(), BLAKE3_OUT_LEN);
     return result;
@@ -300,4 +412,44 @@ constexpr HashAlgorithm HashAlgorithm::g_hashers[] =
   { "SHA3-384", 48, sha3_384_exts, hash_context_factory<Sha3_384HashContext>, true },
   { "SHA3-512", 64, sha3_512_exts, hash_context_factory<Sha3_512HashContext>, true },
   { "BLAKE3", 32, no_exts, hash_context_factory<Blake3HashContext>, true },
-};
\ No newline at end of file
+};
+
+namespace
+{
+  // Enough for all files that can be in flight at once, the rest is freed
+  constexpr size_t k_max_pooled_contexts = 256;
+
+  struct ContextPool
+  {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<HashContext>> contexts;
+  };
+
+  ContextPool s_context_pools[HashAlgorithm::k_count];
+}
+
+HashContext* HashAlgorithm::AcquireContext() const
+{
+  auto& pool = s_context_pools[Idx()];
+  {
+    std::lock_guard<std::mutex> guard{ pool.mutex };
+    if (!pool.contexts.empty())
+    {
+      const auto ctx = pool.contexts.back().release();
+      pool.contexts.pop_back();
+      return ctx;
+    }
+  }
+  return MakeContext();
+}
+
+void HashAlgorithm::ReleaseContext(HashContext* ctx)
+{
+  std::unique_ptr<HashContext> owned{ ctx };
+  ctx->SetParallelJoin(nullptr);
+  ctx->Clear();
+  auto& pool = s_context_pools[ctx->GetAlgorithm()->Idx()];
+  std::lock_guard<std::mutex> guard{ pool.mutex };
+  if (pool.contexts.size() < k_max_pooled_contexts)
+    pool.contexts.push_back(std::move(owned));
+}
\ No newline at end of file
@@ -14,12 +14,86 @@
 //    You should have received a copy of the GNU General Public License
 //    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
 #pragma once
+#include <cassert>
 #include <cstdint>
-#include <vector>
+#include <cstring>
+#include <functional>
+#include <iterator>
 #include <string_view>
 
 class HashAlgorithm;
 
+// A digest of up to k_capacity bytes, stored inline. Results of every file and algorithm are kept around until the
+// window closes, so these shouldn't be a heap allocation each.
+class HashDigest
+{
+public:
+  constexpr static size_t k_capacity = 64;
+
+private:
+  uint8_t _size{};
+  uint8_t _bytes[k_capacity]{};
+
+public:
+  constexpr HashDigest() = default;
+  HashDigest(const uint8_t* data, size_t size)
+  {
+    assert(size <= k_capacity);
+    _size = static_cast<uint8_t>(size);
+    memcpy(_bytes, data, size);
+  }
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  uint8_t* data() { return _bytes; }
+  const uint8_t* data() const { return _bytes; }
+  const uint8_t* begin() const { return _bytes; }
+  const uint8_t* end() const { return _bytes + _size; }
+  uint8_t& operator[](size_t i) { return _bytes[i]; }
+  uint8_t operator[](size_t i) const { return _bytes[i]; }
+
+  void clear() { _size = 0; }
+
+  void resize(size_t size)
+  {
+    assert(size <= k_capacity);
+    _size = static_cast<uint8_t>(size);
+  }
+
+  // Returns false and leaves the digest unchanged if it's already full
+  bool push_back(uint8_t b)
+  {
+    if (_size == k_capacity)
+      return false;
+    _bytes[_size++] = b;
+    return true;
+  }
+
+  // Digests are already uniformly distributed, so the first few bytes make a good enough hash
+  size_t Hash() const
+  {
+    uint64_t v{};
+    memcpy(&v, _bytes, _size < sizeof(v) ? _size : sizeof(v));
+    return static_cast<size_t>(v ^ (v >> 32) ^ _size);
+  }
+
+  friend bool operator==(const HashDigest& lhs, const HashDigest& rhs)
+  {
+    return lhs._size == rhs._size && 0 == memcmp(lhs._bytes, rhs._bytes, lhs._size);
+  }
+
+  friend bool operator!=(const HashDigest& lhs, const HashDigest& rhs) { return !(lhs == rhs); }
+};
+
+namespace std
+{
+  template <>
+  struct hash<HashDigest>
+  {
+    size_t operator()(const HashDigest& digest) const noexcept { return digest.Hash(); }
+  };
+}
+
 class HashContext
 {
   const HashAlgorithm* _algorithm{};
@@ -35,8 +109,23 @@ public:
   virtual ~HashContext() = default;
   virtual void Clear() = 0;
   virtual void Update(const void* data, size_t size) = 0;
-  virtual std::vector<uint8_t> Finish() = 0;
+  virtual HashDigest Finish() = 0;
   const HashAlgorithm* GetAlgorithm() const { return _algorithm; }
+
+  // For multi-buffer hashing. Contexts that return their chaining state here allow whole blocks to be compressed
+  // into it from the outside while GetBufferedSize() is zero, which then must be reported with AddRawBlocks().
+  virtual uint32_t* GetRawState() { return nullptr; }
+  virtual size_t GetBufferedSize() const { return 0; }
+  virtual void AddRawBlocks(size_t count) { (void)count; }
+
+  // For hashing a single large file on multiple threads. Tree hashes may split an Update() into subtrees and pass
+  // them to join, which must run task(left) and task(right), possibly in parallel, and return once both are done.
+  using ParallelJoinFn = void(void (*task)(void*), void* left, void* right);
+  virtual void SetParallelJoin(ParallelJoinFn* join) { (void)join; }
+
+  // For holes in sparse files. Contexts that can skip ahead over a run of zeros without looking at them do so and
+  // return true, the others want them passed to Update() like any other data.
+  virtual bool UpdateZeros(uint64_t count) { (void)count; return false; }
 };
 
 class HashAlgorithm
@@ -44,7 +133,7 @@ class HashAlgorithm
 public:
   using FactoryFn = HashContext* (const HashAlgorithm* algorithm);
   constexpr static auto k_count = 15;
-  constexpr static auto k_max_size = 64;
+  constexpr static auto k_max_size = HashDigest::k_capacity;
   static const HashAlgorithm g_hashers[k_count];
   static constexpr const HashAlgorithm* ByName(std::string_view name)
   {
@@ -93,4 +182,9 @@ public:
   constexpr uint32_t GetSize() const { return _size; }
   constexpr const char* const* GetExtensions() const { return _extensions; }
   constexpr HashContext* MakeContext() const { return _factory_fn(this); }
+
+  // Pooled contexts, for when a lot of short lived ones are needed. AcquireContext() hands out a cleared context,
+  // ReleaseContext() clears it and keeps it for the next caller instead of freeing it.
+  HashContext* AcquireContext() const;
+  static void ReleaseContext(HashContext* ctx);
 };
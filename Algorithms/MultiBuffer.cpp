@@ -0,0 +1,148 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#include "MultiBuffer.h"
+
+#include "Hasher.h"
+#include "cpu_features.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <thread>
+
+using Engines = std::array<MultiBufferHasher*, HashAlgorithm::k_count>;
+
+static Engines MakeEngines()
+{
+  Engines engines{};
+#if defined(CPU_FEATURES_X86)
+  const auto features = cpu_get_features();
+  const auto avx512 = (features & (CPU_AVX512F | CPU_AVX512BW)) == (CPU_AVX512F | CPU_AVX512BW);
+  const auto avx2 = (features & CPU_AVX2) != 0;
+  const auto max_drainers = std::max(1u, std::thread::hardware_concurrency());
+
+  // These live as long as the process, drainers might still be running when we'd want to free them
+  const auto make = [&](mb_blocks_fn* fn_x8, mb_blocks_fn* fn_x16) -> MultiBufferHasher*
+  {
+    if (avx512)
+      return new MultiBufferHasher(fn_x16, 16, max_drainers);
+    if (avx2)
+      return new MultiBufferHasher(fn_x8, 8, max_drainers);
+    return nullptr;
+  };
+
+  engines[HashAlgorithm::IdxByName("MD5")] = make(&md5_mb_avx2, &md5_mb_avx512);
+
+  // A single stream with the SHA extensions is already fast, and doesn't depend on having enough files in flight
+  if (!(features & CPU_SHA))
+  {
+    engines[HashAlgorithm::IdxByName("SHA-1")] = make(&sha1_mb_avx2, &sha1_mb_avx512);
+
+    // SHA-224 is SHA-256 with a different IV, they can share lanes
+    const auto sha256 = make(&sha256_mb_avx2, &sha256_mb_avx512);
+    engines[HashAlgorithm::IdxByName("SHA-224")] = sha256;
+    engines[HashAlgorithm::IdxByName("SHA-256")] = sha256;
+  }
+#endif
+  return engines;
+}
+
+MultiBufferHasher* MultiBufferHasher::ForAlgorithm(const HashAlgorithm* algorithm)
+{
+  static const Engines s_engines = MakeEngines();
+  return s_engines[algorithm->Idx()];
+}
+
+bool MultiBufferHasher::Submit(const Job& job)
+{
+  assert(job.blocks != 0);
+
+  std::lock_guard<std::mutex> guard{ _mutex };
+  _pending.push_back(job);
+
+  // Start another drainer when more is waiting than a running one could pick up
+  if (_drainers == 0 || (_pending.size() > _lanes && _drainers < _max_drainers))
+  {
+    ++_drainers;
+    return true;
+  }
+  return false;
+}
+
+void MultiBufferHasher::Drain()
+{
+  // Idle lanes hash garbage into these, so the kernels don't need a lane mask
+  static const uint8_t s_idle_data[k_max_quantum * 64]{};
+  uint32_t idle_state[8]{};
+
+  Job lanes[k_max_lanes]{};
+  Job finished[k_max_lanes];
+  uint32_t* states[k_max_lanes];
+  const uint8_t* data[k_max_lanes];
+
+  while (true)
+  {
+    size_t active = 0;
+    {
+      std::lock_guard<std::mutex> guard{ _mutex };
+      for (size_t i = 0; i < _lanes; ++i)
+      {
+        if (!lanes[i].blocks && !_pending.empty())
+        {
+          lanes[i] = _pending.front();
+          _pending.pop_front();
+        }
+        active += lanes[i].blocks != 0;
+      }
+      if (!active)
+      {
+        --_drainers;
+        return;
+      }
+    }
+
+    // Run until the shortest job finishes, then refill its lane
+    auto quantum = k_max_quantum;
+    for (size_t i = 0; i < _lanes; ++i)
+      if (lanes[i].blocks)
+        quantum = std::min(quantum, lanes[i].blocks);
+
+    for (size_t i = 0; i < _lanes; ++i)
+    {
+      const auto busy = lanes[i].blocks != 0;
+      states[i] = busy ? lanes[i].state : idle_state;
+      data[i] = busy ? lanes[i].data : s_idle_data;
+    }
+
+    _kernel(states, data, quantum);
+
+    size_t finished_count = 0;
+    for (size_t i = 0; i < _lanes; ++i)
+    {
+      auto& lane = lanes[i];
+      if (!lane.blocks)
+        continue;
+      lane.data += quantum * 64;
+      lane.blocks -= quantum;
+      if (!lane.blocks)
+        finished[finished_count++] = lane;
+    }
+
+    // Completions are free to submit more work
+    for (size_t i = 0; i < finished_count; ++i)
+      finished[i].completion(finished[i].param);
+  }
+}
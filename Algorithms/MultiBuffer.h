@@ -0,0 +1,85 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+#include "mb_hash.h"
+
+class HashAlgorithm;
+
+// Hashes many independent streams of the same algorithm at once, one per SIMD lane. Jobs are whole blocks on the
+// raw state of a context (see HashContext::GetRawState), submitted from any thread. Whoever gets true from Submit()
+// must arrange for Drain() to be called, that thread then keeps the lanes full until the queue runs dry.
+class MultiBufferHasher
+{
+public:
+  using CompletionFn = void(void* param);
+
+  struct Job
+  {
+    uint32_t* state;
+    const uint8_t* data;
+    size_t blocks;
+    CompletionFn* completion;
+    void* param;
+  };
+
+  constexpr static size_t k_max_lanes = 16;
+
+  // Upper bound of blocks per kernel call, so a lane that frees up gets a new job soon
+  constexpr static size_t k_max_quantum = 256;
+
+  // nullptr if there is no multi-buffer kernel for this algorithm, or it wouldn't beat the single stream code
+  static MultiBufferHasher* ForAlgorithm(const HashAlgorithm* algorithm);
+
+  // Streams that may submit jobs, counted from when their context is taken until their digest is final
+  void AddStream() { ++_streams; }
+  void RemoveStream() { --_streams; }
+
+  // With fewer streams than this, most lanes would hash nothing and a single stream is faster hashed on its own
+  bool IsWorthIt() const { return _streams >= _lanes - _lanes / 4; }
+
+  // Returns true if the caller should start a new Drain()
+  bool Submit(const Job& job);
+
+  // Runs until there are no more jobs for this drainer, calling completions as jobs finish
+  void Drain();
+
+  MultiBufferHasher(mb_blocks_fn* kernel, size_t lanes, unsigned max_drainers)
+    : _kernel(kernel)
+    , _lanes(lanes)
+    , _max_drainers(max_drainers) {}
+
+  MultiBufferHasher(const MultiBufferHasher&) = delete;
+  MultiBufferHasher(MultiBufferHasher&&) = delete;
+  MultiBufferHasher& operator=(const MultiBufferHasher&) = delete;
+  MultiBufferHasher& operator=(MultiBufferHasher&&) = delete;
+
+private:
+  mb_blocks_fn* _kernel;
+  size_t _lanes;
+  unsigned _max_drainers;
+
+  std::mutex _mutex;
+  std::deque<Job> _pending;
+  unsigned _drainers{};
+
+  std::atomic<size_t> _streams{};
+};
@@ -1,6 +1,8 @@
 // Public domain
 // Based on public domain 7zip implementation by Igor Pavlov and Samuel Neves
 #include "blake2sp.h"
+#include "blake2sp_impl.h"
+#include "cpu_features.h"
 
 #ifdef LITTLE_ENDIAN_UNALIGNED
 
@@ -242,9 +244,51 @@ void Blake2sp_Init(CBlake2sp *p)
 }
 
 
+static blake2sp_compress_fn *Blake2sp_Get_Compress(void)
+{
+#if defined(CPU_FEATURES_X86)
+  const uint32_t features = cpu_get_features();
+  if (features & CPU_AVX2)
+    return &Blake2sp_Compress_Avx2;
+  if (features & CPU_SSE41)
+    return &Blake2sp_Compress_Sse41;
+#endif
+  return NULL;
+}
+
+
 void Blake2sp_Update(CBlake2sp *p, const uint8_t *data, size_t size)
 {
   unsigned pos = p->bufPos;
+
+  /* On a superblock boundary every leaf holds either nothing or one full block the scalar code keeps back in case
+     it's the last one. Once each leaf is sure to get more data, those can be compressed, and whole superblocks go
+     straight to the SIMD kernel. The last one stays with the scalar path so every leaf ends with a pending block. */
+  if (pos == 0 && size > BLAKE2S_BLOCK_SIZE * BLAKE2SP_PARALLEL_DEGREE * 2)
+  {
+    const size_t superblocks = (size - (BLAKE2S_BLOCK_SIZE * (BLAKE2SP_PARALLEL_DEGREE - 1) + 1))
+      / (BLAKE2S_BLOCK_SIZE * BLAKE2SP_PARALLEL_DEGREE);
+    blake2sp_compress_fn *compress = Blake2sp_Get_Compress();
+    if (compress && superblocks)
+    {
+      unsigned i;
+      for (i = 0; i < BLAKE2SP_PARALLEL_DEGREE; i++)
+      {
+        CBlake2s *leaf = &p->S[i];
+        if (leaf->bufPos == BLAKE2S_BLOCK_SIZE)
+        {
+          leaf->t[0] += BLAKE2S_BLOCK_SIZE;
+          leaf->t[1] += (leaf->t[0] < BLAKE2S_BLOCK_SIZE);
+          Blake2s_Compress(leaf);
+          leaf->bufPos = 0;
+        }
+      }
+      compress(p->S, data, superblocks);
+      data += superblocks * BLAKE2S_BLOCK_SIZE * BLAKE2SP_PARALLEL_DEGREE;
+      size -= superblocks * BLAKE2S_BLOCK_SIZE * BLAKE2SP_PARALLEL_DEGREE;
+    }
+  }
+
   while (size != 0)
   {
     unsigned index = pos / BLAKE2S_BLOCK_SIZE;
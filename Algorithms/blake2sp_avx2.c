@@ -0,0 +1,68 @@
+// Public domain
+// 8 leaves at once on AVX2, see blake2sp_simd.inc.
+
+#include "blake2sp_impl.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+typedef __m256i vec;
+
+#define B2_LANES 8
+#define B2_FN Blake2sp_Compress_Avx2
+
+#define V_ADD(a, b) _mm256_add_epi32((a), (b))
+#define V_XOR(a, b) _mm256_xor_si256((a), (b))
+#define V_SET1(x) _mm256_set1_epi32(x)
+#define V_LOADU(p) _mm256_loadu_si256((const __m256i *)(p))
+#define V_STOREU(p, x) _mm256_storeu_si256((__m256i *)(p), (x))
+#define V_ROTR16(x) _mm256_shuffle_epi8((x), _mm256_setr_epi8( \
+  2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13))
+#define V_ROTR8(x) _mm256_shuffle_epi8((x), _mm256_setr_epi8( \
+  1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12, 1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12))
+#define V_ROTR12(x) _mm256_or_si256(_mm256_srli_epi32((x), 12), _mm256_slli_epi32((x), 20))
+#define V_ROTR7(x) _mm256_or_si256(_mm256_srli_epi32((x), 7), _mm256_slli_epi32((x), 25))
+
+static void b2_transpose8(vec out[8], const vec r[8])
+{
+  const vec t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+  const vec t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+  const vec t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+  const vec t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+  const vec t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+  const vec t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+  const vec t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+  const vec t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+  const vec u0 = _mm256_unpacklo_epi64(t0, t2);
+  const vec u1 = _mm256_unpackhi_epi64(t0, t2);
+  const vec u2 = _mm256_unpacklo_epi64(t1, t3);
+  const vec u3 = _mm256_unpackhi_epi64(t1, t3);
+  const vec u4 = _mm256_unpacklo_epi64(t4, t6);
+  const vec u5 = _mm256_unpackhi_epi64(t4, t6);
+  const vec u6 = _mm256_unpacklo_epi64(t5, t7);
+  const vec u7 = _mm256_unpackhi_epi64(t5, t7);
+  out[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  out[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  out[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  out[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  out[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  out[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  out[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  out[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+static void b2_load_msg(vec m[16], const uint8_t *data)
+{
+  unsigned half, l;
+  for (half = 0; half < 2; half++)
+  {
+    vec r[8];
+    for (l = 0; l < B2_LANES; l++)
+      r[l] = V_LOADU(data + l * BLAKE2S_BLOCK_SIZE + half * 32);
+    b2_transpose8(m + half * 8, r);
+  }
+}
+
+#include "blake2sp_simd.inc"
@@ -0,0 +1,15 @@
+// Public domain
+#pragma once
+
+#include "blake2sp.h"
+
+EXTERN_C_START
+
+// Compresses `superblocks` runs of 8 x 64 bytes straight into the leaves, leaf i taking bytes [64 * i, 64 * i + 64)
+// of each run. Only valid while no leaf holds buffered data, and the final flags are left untouched.
+typedef void blake2sp_compress_fn(CBlake2s S[BLAKE2SP_PARALLEL_DEGREE], const uint8_t *data, size_t superblocks);
+
+void Blake2sp_Compress_Sse41(CBlake2s S[BLAKE2SP_PARALLEL_DEGREE], const uint8_t *data, size_t superblocks);
+void Blake2sp_Compress_Avx2(CBlake2s S[BLAKE2SP_PARALLEL_DEGREE], const uint8_t *data, size_t superblocks);
+
+EXTERN_C_END
@@ -0,0 +1,46 @@
+// Public domain
+// 4 leaves at once on SSE4.1, see blake2sp_simd.inc.
+
+#include "blake2sp_impl.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+typedef __m128i vec;
+
+#define B2_LANES 4
+#define B2_FN Blake2sp_Compress_Sse41
+
+#define V_ADD(a, b) _mm_add_epi32((a), (b))
+#define V_XOR(a, b) _mm_xor_si128((a), (b))
+#define V_SET1(x) _mm_set1_epi32(x)
+#define V_LOADU(p) _mm_loadu_si128((const __m128i *)(p))
+#define V_STOREU(p, x) _mm_storeu_si128((__m128i *)(p), (x))
+#define V_ROTR16(x) _mm_shuffle_epi8((x), _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13))
+#define V_ROTR8(x) _mm_shuffle_epi8((x), _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12))
+#define V_ROTR12(x) _mm_or_si128(_mm_srli_epi32((x), 12), _mm_slli_epi32((x), 20))
+#define V_ROTR7(x) _mm_or_si128(_mm_srli_epi32((x), 7), _mm_slli_epi32((x), 25))
+
+static void b2_load_msg(vec m[16], const uint8_t *data)
+{
+  unsigned quarter;
+  for (quarter = 0; quarter < 4; quarter++)
+  {
+    const vec r0 = V_LOADU(data + 0 * BLAKE2S_BLOCK_SIZE + quarter * 16);
+    const vec r1 = V_LOADU(data + 1 * BLAKE2S_BLOCK_SIZE + quarter * 16);
+    const vec r2 = V_LOADU(data + 2 * BLAKE2S_BLOCK_SIZE + quarter * 16);
+    const vec r3 = V_LOADU(data + 3 * BLAKE2S_BLOCK_SIZE + quarter * 16);
+    const vec t0 = _mm_unpacklo_epi32(r0, r1);
+    const vec t1 = _mm_unpackhi_epi32(r0, r1);
+    const vec t2 = _mm_unpacklo_epi32(r2, r3);
+    const vec t3 = _mm_unpackhi_epi32(r2, r3);
+    m[quarter * 4 + 0] = _mm_unpacklo_epi64(t0, t2);
+    m[quarter * 4 + 1] = _mm_unpackhi_epi64(t0, t2);
+    m[quarter * 4 + 2] = _mm_unpacklo_epi64(t1, t3);
+    m[quarter * 4 + 3] = _mm_unpackhi_epi64(t1, t3);
+  }
+}
+
+#include "blake2sp_simd.inc"
@@ -259,11 +259,46 @@ INLINE size_t compress_parents_parallel(const uint8_t *child_chaining_values,
 // Why not just have the caller split the input on the first update(), instead
 // of implementing this special rule? Because we don't want to limit SIMD or
 // multi-threading parallelism for that update().
+//
+// If join is not NULL, the left and right subtrees of large inputs are handed
+// to it, so they may be hashed on different threads. The chaining values are
+// merged here afterwards exactly as in the serial case, so the output doesn't
+// change.
+static size_t blake3_compress_subtree_wide(const uint8_t *input,
+                                           size_t input_len,
+                                           const uint32_t key[8],
+                                           uint64_t chunk_counter,
+                                           uint8_t flags, uint8_t *out,
+                                           blake3_join_fn *join);
+
+// Subtrees shorter than this are cheaper to hash than to hand to another
+// thread, so they are never split through the join function.
+#define JOIN_MIN_LEN (512 * BLAKE3_CHUNK_LEN)
+
+typedef struct {
+  const uint8_t *input;
+  size_t input_len;
+  const uint32_t *key;
+  uint64_t chunk_counter;
+  uint8_t flags;
+  uint8_t *out;
+  blake3_join_fn *join;
+  size_t num_cvs;
+} subtree_job;
+
+static void compress_subtree_job(void *arg) {
+  subtree_job *job = (subtree_job *)arg;
+  job->num_cvs = blake3_compress_subtree_wide(job->input, job->input_len,
+                                              job->key, job->chunk_counter,
+                                              job->flags, job->out, job->join);
+}
+
 static size_t blake3_compress_subtree_wide(const uint8_t *input,
                                            size_t input_len,
                                            const uint32_t key[8],
                                            uint64_t chunk_counter,
-                                           uint8_t flags, uint8_t *out) {
+                                           uint8_t flags, uint8_t *out,
+                                           blake3_join_fn *join) {
   // Note that the single chunk case does *not* bump the SIMD degree up to 2
   // when it is 1. If this implementation adds multi-threading in the future,
   // this gives us the option of multi-threading even the 2-chunk case, which
@@ -297,12 +332,25 @@ static size_t blake3_compress_subtree_wide(const uint8_t *input,
   }
   uint8_t *right_cvs = &cv_array[degree * BLAKE3_OUT_LEN];
 
-  // Recurse! If this implementation adds multi-threading support in the
-  // future, this is where it will go.
-  size_t left_n = blake3_compress_subtree_wide(input, left_input_len, key,
-                                               chunk_counter, flags, cv_array);
-  size_t right_n = blake3_compress_subtree_wide(
-      right_input, right_input_len, key, right_chunk_counter, flags, right_cvs);
+  // Recurse! Both halves are independent, so with a join function they can
+  // be hashed in parallel.
+  size_t left_n;
+  size_t right_n;
+  if (join != NULL && input_len >= JOIN_MIN_LEN) {
+    subtree_job left = {input,   left_input_len, key, chunk_counter,
+                        flags,   cv_array,       join, 0};
+    subtree_job right = {right_input, right_input_len, key, right_chunk_counter,
+                         flags,       right_cvs,       join, 0};
+    join(compress_subtree_job, &left, &right);
+    left_n = left.num_cvs;
+    right_n = right.num_cvs;
+  } else {
+    left_n = blake3_compress_subtree_wide(input, left_input_len, key,
+                                          chunk_counter, flags, cv_array, join);
+    right_n =
+        blake3_compress_subtree_wide(right_input, right_input_len, key,
+                                     right_chunk_counter, flags, right_cvs, join);
+  }
 
   // The special case again. If simd_degree=1, then we'll have left_n=1 and
   // right_n=1. Rather than compressing them into a single output, return
@@ -330,14 +378,15 @@ static size_t blake3_compress_subtree_wide(const uint8_t *input,
 // chunk or less. That's a different codepath.
 INLINE void compress_subtree_to_parent_node(
     const uint8_t *input, size_t input_len, const uint32_t key[8],
-    uint64_t chunk_counter, uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN]) {
+    uint64_t chunk_counter, uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN],
+    blake3_join_fn *join) {
 #if defined(BLAKE3_TESTING)
   assert(input_len > BLAKE3_CHUNK_LEN);
 #endif
 
   uint8_t cv_array[MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN];
-  size_t num_cvs = blake3_compress_subtree_wide(input, input_len, key,
-                                                chunk_counter, flags, cv_array);
+  size_t num_cvs = blake3_compress_subtree_wide(
+      input, input_len, key, chunk_counter, flags, cv_array, join);
 
   // If MAX_SIMD_DEGREE is greater than 2 and there's enough input,
   // compress_subtree_wide() returns more than 2 chaining values. Condense
@@ -439,8 +488,8 @@ INLINE void hasher_push_cv(blake3_hasher *self, uint8_t new_cv[BLAKE3_OUT_LEN],
   self->cv_stack_len += 1;
 }
 
-void blake3_hasher_update(blake3_hasher *self, const void *input,
-                          size_t input_len) {
+static void hasher_update(blake3_hasher *self, const void *input,
+                          size_t input_len, blake3_join_fn *join) {
   // Explicitly checking for zero avoids causing UB by passing a null pointer
   // to memcpy. This comes up in practice with things like:
   //   std::vector<uint8_t> v;
@@ -526,7 +575,7 @@ void blake3_hasher_update(blake3_hasher *self, const void *input,
       uint8_t cv_pair[2 * BLAKE3_OUT_LEN];
       compress_subtree_to_parent_node(input_bytes, subtree_len, self->key,
                                       self->chunk.chunk_counter,
-                                      self->chunk.flags, cv_pair);
+                                      self->chunk.flags, cv_pair, join);
       hasher_push_cv(self, cv_pair, self->chunk.chunk_counter);
       hasher_push_cv(self, &cv_pair[BLAKE3_OUT_LEN],
                      self->chunk.chunk_counter + (subtree_chunks / 2));
@@ -548,6 +597,16 @@ void blake3_hasher_update(blake3_hasher *self, const void *input,
   }
 }
 
+void blake3_hasher_update(blake3_hasher *self, const void *input,
+                          size_t input_len) {
+  hasher_update(self, input, input_len, NULL);
+}
+
+void blake3_hasher_update_join(blake3_hasher *self, const void *input,
+                               size_t input_len, blake3_join_fn *join) {
+  hasher_update(self, input, input_len, join);
+}
+
 void blake3_hasher_finalize(const blake3_hasher *self, uint8_t *out,
                             size_t out_len) {
   blake3_hasher_finalize_seek(self, 0, out, out_len);
@@ -4,11 +4,6 @@
 #include <stddef.h>
 #include <stdint.h>
 
-// sorry but i couldn't get it work with clang
-#ifndef __x86_64__
-#define BLAKE3_NO_SSE41
-#endif
-
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -43,12 +38,20 @@ typedef struct {
   uint8_t cv_stack[(BLAKE3_MAX_DEPTH + 1) * BLAKE3_OUT_LEN];
 } blake3_hasher;
 
+// Must call task(left) and task(right), possibly in parallel, and return only
+// after both have finished.
+typedef void blake3_join_fn(void (*task)(void *), void *left, void *right);
+
 void blake3_hasher_init(blake3_hasher *self);
 void blake3_hasher_init_keyed(blake3_hasher *self,
                               const uint8_t key[BLAKE3_KEY_LEN]);
 void blake3_hasher_init_derive_key(blake3_hasher *self, const char *context);
 void blake3_hasher_update(blake3_hasher *self, const void *input,
                           size_t input_len);
+// Same as blake3_hasher_update(), but large subtrees of the input are split
+// through join, so they can be hashed on multiple threads.
+void blake3_hasher_update_join(blake3_hasher *self, const void *input,
+                               size_t input_len, blake3_join_fn *join);
 void blake3_hasher_finalize(const blake3_hasher *self, uint8_t *out,
                             size_t out_len);
 void blake3_hasher_finalize_seek(const blake3_hasher *self, uint64_t seek,
@@ -149,6 +149,12 @@ void blake3_compress_in_place(uint32_t cv[8],
     return;
   }
 #endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    blake3_compress_in_place_sse2(cv, block, block_len, counter, flags);
+    return;
+  }
+#endif
 #endif
   blake3_compress_in_place_portable(cv, block, block_len, counter, flags);
 }
@@ -171,6 +177,12 @@ void blake3_compress_xof(const uint32_t cv[8],
     return;
   }
 #endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    blake3_compress_xof_sse2(cv, block, block_len, counter, flags, out);
+    return;
+  }
+#endif
 #endif
   blake3_compress_xof_portable(cv, block, block_len, counter, flags, out);
 }
@@ -205,6 +217,14 @@ void blake3_hash_many(const uint8_t *const *inputs, size_t num_inputs,
     return;
   }
 #endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    blake3_hash_many_sse2(inputs, num_inputs, blocks, key, counter,
+                          increment_counter, flags, flags_start, flags_end,
+                          out);
+    return;
+  }
+#endif
 #endif
 
 #if defined(BLAKE3_USE_NEON)
@@ -237,6 +257,11 @@ size_t blake3_simd_degree(void) {
     return 4;
   }
 #endif
+#if !defined(BLAKE3_NO_SSE2)
+  if (features & SSE2) {
+    return 4;
+  }
+#endif
 #endif
 #if defined(BLAKE3_USE_NEON)
   return 4;
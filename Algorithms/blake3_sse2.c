@@ -0,0 +1,17 @@
+#include "blake3_impl.h"
+
+#include <immintrin.h>
+
+#define SSE_FN(name) name##_sse2
+
+// No pshufb here. A 16 bit rotation is swapping the halves of each word, and
+// 8 bits are just shifts like the other two.
+INLINE __m128i rot16(__m128i x) {
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+}
+
+INLINE __m128i rot8(__m128i x) {
+  return _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 32 - 8));
+}
+
+#include "blake3_sse.inc"
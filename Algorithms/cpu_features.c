@@ -0,0 +1,114 @@
+// public domain
+#include "cpu_features.h"
+
+#if defined(CPU_FEATURES_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__)
+#include <immintrin.h>
+#else
+#error "Unimplemented!"
+#endif
+#endif
+
+#define CPU_FEATURES_UNDEFINED (1u << 31)
+
+static volatile uint32_t g_cpu_features = CPU_FEATURES_UNDEFINED;
+
+#if defined(CPU_FEATURES_X86)
+static uint64_t xgetbv(void) {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  uint32_t eax = 0, edx = 0;
+  __asm__ __volatile__("xgetbv\n" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static void cpuidex(uint32_t out[4], uint32_t id, uint32_t sid) {
+#if defined(_MSC_VER)
+  __cpuidex((int *)out, id, sid);
+#elif defined(__i386__) || defined(_M_IX86)
+  __asm__ __volatile__("movl %%ebx, %1\n"
+                       "cpuid\n"
+                       "xchgl %1, %%ebx\n"
+                       : "=a"(out[0]), "=r"(out[1]), "=c"(out[2]), "=d"(out[3])
+                       : "a"(id), "c"(sid));
+#else
+  __asm__ __volatile__("cpuid\n"
+                       : "=a"(out[0]), "=b"(out[1]), "=c"(out[2]), "=d"(out[3])
+                       : "a"(id), "c"(sid));
+#endif
+}
+
+static uint32_t detect(void) {
+  uint32_t regs[4] = {0};
+  uint32_t *eax = &regs[0], *ebx = &regs[1], *ecx = &regs[2], *edx = &regs[3];
+  (void)edx;
+  uint32_t features = 0;
+  cpuidex(regs, 0, 0);
+  const uint32_t max_id = *eax;
+  cpuidex(regs, 1, 0);
+  const uint32_t leaf1_ecx = *ecx;
+#if defined(__x86_64__) || defined(_M_X64)
+  features |= CPU_SSE2;
+#else
+  if (*edx & (1UL << 26))
+    features |= CPU_SSE2;
+#endif
+  if (leaf1_ecx & (1UL << 9))
+    features |= CPU_SSSE3;
+  if (leaf1_ecx & (1UL << 19))
+    features |= CPU_SSE41;
+  if (leaf1_ecx & (1UL << 1))
+    features |= CPU_PCLMUL;
+
+  if (max_id >= 7) {
+    cpuidex(regs, 7, 0);
+    // SHA and BMI2 only touch XMM / GPR state, they don't need the OS to enable anything
+    if (*ebx & (1UL << 29))
+      features |= CPU_SHA;
+    if (*ebx & (1UL << 8))
+      features |= CPU_BMI2;
+  }
+
+  if (leaf1_ecx & (1UL << 27)) { // OSXSAVE
+    const uint64_t mask = xgetbv();
+    if ((mask & 6) == 6) { // SSE and AVX states
+      if (leaf1_ecx & (1UL << 28))
+        features |= CPU_AVX;
+      if (max_id >= 7) {
+        cpuidex(regs, 7, 0);
+        if (*ebx & (1UL << 5))
+          features |= CPU_AVX2;
+        if ((mask & 224) == 224) { // Opmask, ZMM_Hi256, Hi16_Zmm
+          if (*ebx & (1UL << 16))
+            features |= CPU_AVX512F;
+          if (*ebx & (1UL << 31))
+            features |= CPU_AVX512VL;
+          if (*ebx & (1UL << 30))
+            features |= CPU_AVX512BW;
+          if (*ecx & (1UL << 10))
+            features |= CPU_VPCLMULQDQ;
+        }
+      }
+    }
+  }
+  return features;
+}
+#endif
+
+uint32_t cpu_get_features(void) {
+  uint32_t features = g_cpu_features;
+  if (features == CPU_FEATURES_UNDEFINED) {
+#if defined(CPU_FEATURES_X86)
+    features = detect();
+#else
+    features = 0;
+#endif
+    // Racing threads all compute the same value, so a plain store is fine
+    g_cpu_features = features;
+  }
+  return features;
+}
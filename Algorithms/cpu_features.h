@@ -0,0 +1,40 @@
+// public domain
+#pragma once
+
+#ifndef EXTERN_C_START
+#ifdef __cplusplus
+#define EXTERN_C_START extern "C" {
+#define EXTERN_C_END }
+#else
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+#endif
+
+EXTERN_C_START
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_FEATURES_X86
+#endif
+
+enum cpu_feature_flag {
+  CPU_SSE2 = 1 << 0,
+  CPU_SSSE3 = 1 << 1,
+  CPU_SSE41 = 1 << 2,
+  CPU_PCLMUL = 1 << 3,
+  CPU_AVX = 1 << 4,
+  CPU_AVX2 = 1 << 5,
+  CPU_BMI2 = 1 << 6,
+  CPU_SHA = 1 << 7,
+  CPU_AVX512F = 1 << 8,
+  CPU_AVX512VL = 1 << 9,
+  CPU_AVX512BW = 1 << 10,
+  CPU_VPCLMULQDQ = 1 << 11,
+};
+
+// Detected once, then cached. Same probe as blake3_dispatch.c, with a few more leaves for our own kernels.
+uint32_t cpu_get_features(void);
+
+EXTERN_C_END
@@ -18,4 +18,7 @@ EXTERN_C_START
 
 extern uint32_t Crc32_ComputeBuf(uint32_t inCrc32, const void* buf, size_t bufLen);
 
+// Same as Crc32_ComputeBuf() over count zero bytes, in O(log count)
+extern uint32_t Crc32_ComputeZeros(uint32_t inCrc32, uint64_t count);
+
 EXTERN_C_END
\ No newline at end of file
@@ -0,0 +1,73 @@
+// public domain
+// CRC-32 folding with PCLMULQDQ, as described in Intel's "Fast CRC Computation
+// for Generic Polynomials Using PCLMULQDQ Instruction". Constants are the bit
+// reflected x^(D+32) mod P and x^(D-32) mod P for a fold distance of D bits.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+#define CLMUL_FOLD(acc, data, k) \
+  _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((acc), (k), 0x00), _mm_clmulepi64_si128((acc), (k), 0x11)), (data))
+
+uint32_t Crc32_Fold_Pclmul(uint32_t crc, const uint8_t* buf, size_t len)
+{
+  const __m128i k512 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k128 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k64 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  buf += 64;
+  len -= 64;
+
+  // Fold 4 x 128 bits in parallel
+  while (len >= 64)
+  {
+    x1 = CLMUL_FOLD(x1, _mm_loadu_si128((const __m128i*)(buf + 0x00)), k512);
+    x2 = CLMUL_FOLD(x2, _mm_loadu_si128((const __m128i*)(buf + 0x10)), k512);
+    x3 = CLMUL_FOLD(x3, _mm_loadu_si128((const __m128i*)(buf + 0x20)), k512);
+    x4 = CLMUL_FOLD(x4, _mm_loadu_si128((const __m128i*)(buf + 0x30)), k512);
+    buf += 64;
+    len -= 64;
+  }
+
+  // Fold into 128 bits
+  x1 = CLMUL_FOLD(x1, x2, k128);
+  x1 = CLMUL_FOLD(x1, x3, k128);
+  x1 = CLMUL_FOLD(x1, x4, k128);
+
+  while (len >= 16)
+  {
+    x1 = CLMUL_FOLD(x1, _mm_loadu_si128((const __m128i*)buf), k128);
+    buf += 16;
+    len -= 16;
+  }
+
+  // Fold 128 bits to 64 bits
+  __m128i x0;
+  x2 = _mm_clmulepi64_si128(x1, k128, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k64, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_and_si128(x1, mask32);
+  x0 = _mm_clmulepi64_si128(x0, poly, 0x10);
+  x0 = _mm_and_si128(x0, mask32);
+  x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x0);
+
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
@@ -0,0 +1,83 @@
+// public domain
+// CRC-32 folding with VPCLMULQDQ on 512 bit registers. Same scheme as
+// crc32_pclmul.c, just with 16 lanes of 128 bits in flight at once.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+#define CLMUL_FOLD(acc, data, k) \
+  _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((acc), (k), 0x00), _mm_clmulepi64_si128((acc), (k), 0x11)), (data))
+
+#define CLMUL_FOLD512(acc, data, k) \
+  _mm512_ternarylogic_epi64( \
+    _mm512_clmulepi64_epi128((acc), (k), 0x00), \
+    _mm512_clmulepi64_epi128((acc), (k), 0x11), \
+    (data), \
+    0x96)
+
+#define BROADCAST_K(hi, lo) _mm512_set_epi64((hi), (lo), (hi), (lo), (hi), (lo), (hi), (lo))
+
+uint32_t Crc32_Fold_Vpclmul(uint32_t crc, const uint8_t* buf, size_t len)
+{
+  const __m512i k2048 = BROADCAST_K(0x01322d1430, 0x011542778a);
+  const __m512i k512 = BROADCAST_K(0x01c6e41596, 0x0154442bd4);
+  const __m128i k384 = _mm_set_epi64x(0x0174359406, 0x003db1ecdc);
+  const __m128i k256 = _mm_set_epi64x(0x015a546366, 0x00f1da05aa);
+  const __m128i k128 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k64 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m512i x1 = _mm512_loadu_si512((const void*)(buf + 0x00));
+  __m512i x2 = _mm512_loadu_si512((const void*)(buf + 0x40));
+  __m512i x3 = _mm512_loadu_si512((const void*)(buf + 0x80));
+  __m512i x4 = _mm512_loadu_si512((const void*)(buf + 0xC0));
+  x1 = _mm512_xor_si512(x1, _mm512_castsi128_si512(_mm_cvtsi32_si128((int)crc)));
+  buf += 256;
+  len -= 256;
+
+  // Fold 4 x 512 bits in parallel
+  while (len >= 256)
+  {
+    x1 = CLMUL_FOLD512(x1, _mm512_loadu_si512((const void*)(buf + 0x00)), k2048);
+    x2 = CLMUL_FOLD512(x2, _mm512_loadu_si512((const void*)(buf + 0x40)), k2048);
+    x3 = CLMUL_FOLD512(x3, _mm512_loadu_si512((const void*)(buf + 0x80)), k2048);
+    x4 = CLMUL_FOLD512(x4, _mm512_loadu_si512((const void*)(buf + 0xC0)), k2048);
+    buf += 256;
+    len -= 256;
+  }
+
+  // Fold into a single 512 bit register
+  x1 = CLMUL_FOLD512(x1, x2, k512);
+  x1 = CLMUL_FOLD512(x1, x3, k512);
+  x1 = CLMUL_FOLD512(x1, x4, k512);
+
+  // Fold the 4 lanes into 128 bits
+  __m128i a = _mm512_extracti32x4_epi32(x1, 3);
+  a = CLMUL_FOLD(_mm512_extracti32x4_epi32(x1, 0), a, k384);
+  a = _mm_xor_si128(a, CLMUL_FOLD(_mm512_extracti32x4_epi32(x1, 1), _mm_setzero_si128(), k256));
+  a = _mm_xor_si128(a, CLMUL_FOLD(_mm512_extracti32x4_epi32(x1, 2), _mm_setzero_si128(), k128));
+
+  // Fold 128 bits to 64 bits
+  __m128i x0;
+  __m128i b = _mm_clmulepi64_si128(a, k128, 0x10);
+  a = _mm_xor_si128(_mm_srli_si128(a, 8), b);
+  b = _mm_srli_si128(a, 4);
+  a = _mm_and_si128(a, mask32);
+  a = _mm_clmulepi64_si128(a, k64, 0x00);
+  a = _mm_xor_si128(a, b);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_and_si128(a, mask32);
+  x0 = _mm_clmulepi64_si128(x0, poly, 0x10);
+  x0 = _mm_and_si128(x0, mask32);
+  x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+  a = _mm_xor_si128(a, x0);
+
+  return (uint32_t)_mm_extract_epi32(a, 1);
+}
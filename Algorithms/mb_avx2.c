@@ -0,0 +1,78 @@
+// public domain
+// 8 lane multi-buffer hashing on AVX2, see mb_hash.inc.
+
+#include "mb_hash.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+typedef __m256i vec;
+
+#define MB_LANES 8
+#define MB_FN(name) name##_mb_avx2
+
+#define V_ADD(a, b) _mm256_add_epi32((a), (b))
+#define V_XOR(a, b) _mm256_xor_si256((a), (b))
+#define V_OR(a, b) _mm256_or_si256((a), (b))
+#define V_SET1(x) _mm256_set1_epi32(x)
+#define V_LOADU(p) _mm256_loadu_si256((const __m256i*)(p))
+#define V_STOREU(p, x) _mm256_storeu_si256((__m256i*)(p), (x))
+#define V_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+#define V_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define V_SHR(x, n) _mm256_srli_epi32((x), (n))
+#define V_XOR3(a, b, c) V_XOR(V_XOR((a), (b)), (c))
+#define V_CH(x, y, z) V_XOR(_mm256_and_si256(V_XOR((y), (z)), (x)), (z))
+#define V_MAJ(x, y, z) V_OR(_mm256_and_si256((x), (y)), _mm256_and_si256(V_OR((x), (y)), (z)))
+#define V_MD5_I(b, c, d) V_XOR((c), V_OR((b), V_XOR((d), _mm256_set1_epi32(-1))))
+
+// Transpose 8 words from each of the 8 lanes, so out[i] holds word i of every lane
+static void transpose8(vec out[8], const vec r[8])
+{
+  const vec t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+  const vec t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+  const vec t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+  const vec t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+  const vec t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+  const vec t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+  const vec t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+  const vec t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+  const vec u0 = _mm256_unpacklo_epi64(t0, t2);
+  const vec u1 = _mm256_unpackhi_epi64(t0, t2);
+  const vec u2 = _mm256_unpacklo_epi64(t1, t3);
+  const vec u3 = _mm256_unpackhi_epi64(t1, t3);
+  const vec u4 = _mm256_unpacklo_epi64(t4, t6);
+  const vec u5 = _mm256_unpackhi_epi64(t4, t6);
+  const vec u6 = _mm256_unpacklo_epi64(t5, t7);
+  const vec u7 = _mm256_unpackhi_epi64(t5, t7);
+  out[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  out[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  out[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  out[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  out[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  out[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  out[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  out[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+static void mb_load_block(vec W[16], const uint8_t* const data[MB_LANES], size_t offset, int bswap)
+{
+  const vec bswap_mask = _mm256_setr_epi8(
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+  );
+  for (int half = 0; half < 2; ++half)
+  {
+    vec r[8];
+    for (int l = 0; l < MB_LANES; ++l)
+    {
+      r[l] = V_LOADU(data[l] + offset + half * 32);
+      if (bswap)
+        r[l] = _mm256_shuffle_epi8(r[l], bswap_mask);
+    }
+    transpose8(W + half * 8, r);
+  }
+}
+
+#include "mb_hash.inc"
@@ -0,0 +1,73 @@
+// public domain
+// 16 lane multi-buffer hashing on AVX-512, see mb_hash.inc.
+
+#include "mb_hash.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+typedef __m512i vec;
+
+#define MB_LANES 16
+#define MB_FN(name) name##_mb_avx512
+
+#define V_ADD(a, b) _mm512_add_epi32((a), (b))
+#define V_XOR(a, b) _mm512_xor_si512((a), (b))
+#define V_OR(a, b) _mm512_or_si512((a), (b))
+#define V_SET1(x) _mm512_set1_epi32(x)
+#define V_LOADU(p) _mm512_loadu_si512((const void*)(p))
+#define V_STOREU(p, x) _mm512_storeu_si512((void*)(p), (x))
+#define V_ROTL(x, n) _mm512_rol_epi32((x), (n))
+#define V_ROTR(x, n) _mm512_ror_epi32((x), (n))
+#define V_SHR(x, n) _mm512_srli_epi32((x), (n))
+#define V_XOR3(a, b, c) _mm512_ternarylogic_epi32((a), (b), (c), 0x96)
+#define V_CH(x, y, z) _mm512_ternarylogic_epi32((x), (y), (z), 0xCA)
+#define V_MAJ(x, y, z) _mm512_ternarylogic_epi32((x), (y), (z), 0xE8)
+#define V_MD5_I(b, c, d) _mm512_ternarylogic_epi32((b), (c), (d), 0x39)
+
+// Transpose the 16 words of each of the 16 lanes, so W[i] holds word i of every lane
+static void transpose16(vec W[16], const vec r[16])
+{
+  vec t[16], u[16];
+  for (int i = 0; i < 16; i += 2)
+  {
+    t[i] = _mm512_unpacklo_epi32(r[i], r[i + 1]);
+    t[i + 1] = _mm512_unpackhi_epi32(r[i], r[i + 1]);
+  }
+  // u[4g + k] holds words k, k+4, k+8, k+12 of rows 4g..4g+3, one per 128 bit lane
+  for (int g = 0; g < 4; ++g)
+  {
+    u[4 * g + 0] = _mm512_unpacklo_epi64(t[4 * g + 0], t[4 * g + 2]);
+    u[4 * g + 1] = _mm512_unpackhi_epi64(t[4 * g + 0], t[4 * g + 2]);
+    u[4 * g + 2] = _mm512_unpacklo_epi64(t[4 * g + 1], t[4 * g + 3]);
+    u[4 * g + 3] = _mm512_unpackhi_epi64(t[4 * g + 1], t[4 * g + 3]);
+  }
+  for (int k = 0; k < 4; ++k)
+  {
+    const vec x = _mm512_shuffle_i32x4(u[k], u[4 + k], 0x44);
+    const vec y = _mm512_shuffle_i32x4(u[k], u[4 + k], 0xEE);
+    const vec p = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0x44);
+    const vec q = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0xEE);
+    W[k + 0] = _mm512_shuffle_i32x4(x, p, 0x88);
+    W[k + 4] = _mm512_shuffle_i32x4(x, p, 0xDD);
+    W[k + 8] = _mm512_shuffle_i32x4(y, q, 0x88);
+    W[k + 12] = _mm512_shuffle_i32x4(y, q, 0xDD);
+  }
+}
+
+static void mb_load_block(vec W[16], const uint8_t* const data[MB_LANES], size_t offset, int bswap)
+{
+  const vec bswap_mask = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+  vec r[16];
+  for (int l = 0; l < MB_LANES; ++l)
+  {
+    r[l] = V_LOADU(data[l] + offset);
+    if (bswap)
+      r[l] = _mm512_shuffle_epi8(r[l], bswap_mask);
+  }
+  transpose16(W, r);
+}
+
+#include "mb_hash.inc"
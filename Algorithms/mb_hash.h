@@ -0,0 +1,31 @@
+// public domain
+#pragma once
+
+#ifndef EXTERN_C_START
+#ifdef __cplusplus
+#define EXTERN_C_START extern "C" {
+#define EXTERN_C_END }
+#else
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+#endif
+
+EXTERN_C_START
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Multi-buffer block functions: lane i compresses `blocks` whole 64 byte blocks from data[i] into state[i].
+// Every lane runs the same number of blocks, callers point idle lanes at scratch state and data.
+typedef void mb_blocks_fn(uint32_t* const state[], const uint8_t* const data[], size_t blocks);
+
+void md5_mb_avx2(uint32_t* const state[8], const uint8_t* const data[8], size_t blocks);
+void sha1_mb_avx2(uint32_t* const state[8], const uint8_t* const data[8], size_t blocks);
+void sha256_mb_avx2(uint32_t* const state[8], const uint8_t* const data[8], size_t blocks);
+
+void md5_mb_avx512(uint32_t* const state[16], const uint8_t* const data[16], size_t blocks);
+void sha1_mb_avx512(uint32_t* const state[16], const uint8_t* const data[16], size_t blocks);
+void sha256_mb_avx512(uint32_t* const state[16], const uint8_t* const data[16], size_t blocks);
+
+EXTERN_C_END
@@ -69,15 +69,91 @@ static const uint64_t keccakf_rndc[24] = {
     SHA3_CONST(0x0000000080000001UL), SHA3_CONST(0x8000000080008008UL)
 };
 
-static const unsigned keccakf_rotc[24] = {
-    1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14, 27, 41, 56, 8, 25, 43, 62,
-    18, 39, 61, 20, 44
-};
-
-static const unsigned keccakf_piln[24] = {
-    10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4, 15, 23, 19, 13, 12, 2, 20,
-    14, 22, 9, 6, 1
-};
+/* Keccak-f[1600], fully unrolled, with the lane complementing transform from
+ * the Keccak team's optimized implementation: lanes 1, 2, 8, 12, 17 and 20 are
+ * kept inverted during the permutation, which takes chi from 5 NOTs per row
+ * down to 8 per round. The rest of this file only ever sees the plain state,
+ * the lanes are flipped on entry and exit.
+ *
+ * One round reads the lanes A##xx and writes E##xx, so consecutive rounds
+ * swap the two sets. Chi per lane was derived from the complemented inputs.
+ */
+#define KECCAK_COMPLEMENT(s) \
+    do { \
+        (s)[1] = ~(s)[1]; \
+        (s)[2] = ~(s)[2]; \
+        (s)[8] = ~(s)[8]; \
+        (s)[12] = ~(s)[12]; \
+        (s)[17] = ~(s)[17]; \
+        (s)[20] = ~(s)[20]; \
+    } while (0)
+
+#define KECCAK_ROUND(A, E, rc) \
+    do { \
+        uint64_t Ca, Ce, Ci, Co, Cu, Da, De, Di, Do, Du; \
+        uint64_t B0, B1, B2, B3, B4; \
+        Ca = A##ba ^ A##ga ^ A##ka ^ A##ma ^ A##sa; \
+        Ce = A##be ^ A##ge ^ A##ke ^ A##me ^ A##se; \
+        Ci = A##bi ^ A##gi ^ A##ki ^ A##mi ^ A##si; \
+        Co = A##bo ^ A##go ^ A##ko ^ A##mo ^ A##so; \
+        Cu = A##bu ^ A##gu ^ A##ku ^ A##mu ^ A##su; \
+        Da = Cu ^ SHA3_ROTL64(Ce, 1); \
+        De = Ca ^ SHA3_ROTL64(Ci, 1); \
+        Di = Ce ^ SHA3_ROTL64(Co, 1); \
+        Do = Ci ^ SHA3_ROTL64(Cu, 1); \
+        Du = Co ^ SHA3_ROTL64(Ca, 1); \
+        B0 = A##ba ^ Da; \
+        B1 = SHA3_ROTL64(A##ge ^ De, 44); \
+        B2 = SHA3_ROTL64(A##ki ^ Di, 43); \
+        B3 = SHA3_ROTL64(A##mo ^ Do, 21); \
+        B4 = SHA3_ROTL64(A##su ^ Du, 14); \
+        E##ba = B0 ^ (B1 | B2); \
+        E##be = B1 ^ (~B2 | B3); \
+        E##bi = B2 ^ (B3 & B4); \
+        E##bo = B3 ^ (B4 | B0); \
+        E##bu = B4 ^ (B0 & B1); \
+        E##ba ^= (rc); \
+        B0 = SHA3_ROTL64(A##bo ^ Do, 28); \
+        B1 = SHA3_ROTL64(A##gu ^ Du, 20); \
+        B2 = SHA3_ROTL64(A##ka ^ Da, 3); \
+        B3 = SHA3_ROTL64(A##me ^ De, 45); \
+        B4 = SHA3_ROTL64(A##si ^ Di, 61); \
+        E##ga = B0 ^ (B1 | B2); \
+        E##ge = B1 ^ (B2 & B3); \
+        E##gi = B2 ^ (B3 | ~B4); \
+        E##go = B3 ^ (B4 | B0); \
+        E##gu = B4 ^ (B0 & B1); \
+        B0 = SHA3_ROTL64(A##be ^ De, 1); \
+        B1 = SHA3_ROTL64(A##gi ^ Di, 6); \
+        B2 = SHA3_ROTL64(A##ko ^ Do, 25); \
+        B3 = SHA3_ROTL64(A##mu ^ Du, 8); \
+        B4 = SHA3_ROTL64(A##sa ^ Da, 18); \
+        E##ka = B0 ^ (B1 | B2); \
+        E##ke = B1 ^ (B2 & B3); \
+        E##ki = B2 ^ (~B3 & B4); \
+        E##ko = ~B3 ^ (B4 | B0); \
+        E##ku = B4 ^ (B0 & B1); \
+        B0 = SHA3_ROTL64(A##bu ^ Du, 27); \
+        B1 = SHA3_ROTL64(A##ga ^ Da, 36); \
+        B2 = SHA3_ROTL64(A##ke ^ De, 10); \
+        B3 = SHA3_ROTL64(A##mi ^ Di, 15); \
+        B4 = SHA3_ROTL64(A##so ^ Do, 56); \
+        E##ma = B0 ^ (B1 & B2); \
+        E##me = B1 ^ (B2 | B3); \
+        E##mi = B2 ^ (~B3 | B4); \
+        E##mo = ~B3 ^ (B4 & B0); \
+        E##mu = B4 ^ (B0 | B1); \
+        B0 = SHA3_ROTL64(A##bi ^ Di, 62); \
+        B1 = SHA3_ROTL64(A##go ^ Do, 55); \
+        B2 = SHA3_ROTL64(A##ku ^ Du, 39); \
+        B3 = SHA3_ROTL64(A##ma ^ Da, 41); \
+        B4 = SHA3_ROTL64(A##se ^ De, 2); \
+        E##sa = B0 ^ (~B1 & B2); \
+        E##se = ~B1 ^ (B2 | B3); \
+        E##si = B2 ^ (B3 & B4); \
+        E##so = B3 ^ (B4 | B0); \
+        E##su = B4 ^ (B0 & B1); \
+    } while (0)
 
 /* generally called after SHA3_KECCAK_SPONGE_WORDS-ctx->capacityWords words 
  * are XORed into the state s 
@@ -85,42 +161,103 @@ static const unsigned keccakf_piln[24] = {
 static void
 keccakf(uint64_t s[25])
 {
-    int i, j, round;
-    uint64_t t, bc[5];
-#define KECCAK_ROUNDS 24
-
-    for(round = 0; round < KECCAK_ROUNDS; round++) {
-
-        /* Theta */
-        for(i = 0; i < 5; i++)
-            bc[i] = s[i] ^ s[i + 5] ^ s[i + 10] ^ s[i + 15] ^ s[i + 20];
-
-        for(i = 0; i < 5; i++) {
-            t = bc[(i + 4) % 5] ^ SHA3_ROTL64(bc[(i + 1) % 5], 1);
-            for(j = 0; j < 25; j += 5)
-                s[j + i] ^= t;
-        }
-
-        /* Rho Pi */
-        t = s[1];
-        for(i = 0; i < 24; i++) {
-            j = keccakf_piln[i];
-            bc[0] = s[j];
-            s[j] = SHA3_ROTL64(t, keccakf_rotc[i]);
-            t = bc[0];
-        }
-
-        /* Chi */
-        for(j = 0; j < 25; j += 5) {
-            for(i = 0; i < 5; i++)
-                bc[i] = s[j + i];
-            for(i = 0; i < 5; i++)
-                s[j + i] ^= (~bc[(i + 1) % 5]) & bc[(i + 2) % 5];
-        }
+    uint64_t Aba, Abe, Abi, Abo, Abu, Aga, Age, Agi, Ago, Agu, Aka, Ake, Aki,
+        Ako, Aku, Ama, Ame, Ami, Amo, Amu, Asa, Ase, Asi, Aso, Asu;
+    uint64_t Eba, Ebe, Ebi, Ebo, Ebu, Ega, Ege, Egi, Ego, Egu, Eka, Eke, Eki,
+        Eko, Eku, Ema, Eme, Emi, Emo, Emu, Esa, Ese, Esi, Eso, Esu;
+
+    KECCAK_COMPLEMENT(s);
+    Aba = s[0];
+    Abe = s[1];
+    Abi = s[2];
+    Abo = s[3];
+    Abu = s[4];
+    Aga = s[5];
+    Age = s[6];
+    Agi = s[7];
+    Ago = s[8];
+    Agu = s[9];
+    Aka = s[10];
+    Ake = s[11];
+    Aki = s[12];
+    Ako = s[13];
+    Aku = s[14];
+    Ama = s[15];
+    Ame = s[16];
+    Ami = s[17];
+    Amo = s[18];
+    Amu = s[19];
+    Asa = s[20];
+    Ase = s[21];
+    Asi = s[22];
+    Aso = s[23];
+    Asu = s[24];
+
+    KECCAK_ROUND(A, E, keccakf_rndc[0]);
+    KECCAK_ROUND(E, A, keccakf_rndc[1]);
+    KECCAK_ROUND(A, E, keccakf_rndc[2]);
+    KECCAK_ROUND(E, A, keccakf_rndc[3]);
+    KECCAK_ROUND(A, E, keccakf_rndc[4]);
+    KECCAK_ROUND(E, A, keccakf_rndc[5]);
+    KECCAK_ROUND(A, E, keccakf_rndc[6]);
+    KECCAK_ROUND(E, A, keccakf_rndc[7]);
+    KECCAK_ROUND(A, E, keccakf_rndc[8]);
+    KECCAK_ROUND(E, A, keccakf_rndc[9]);
+    KECCAK_ROUND(A, E, keccakf_rndc[10]);
+    KECCAK_ROUND(E, A, keccakf_rndc[11]);
+    KECCAK_ROUND(A, E, keccakf_rndc[12]);
+    KECCAK_ROUND(E, A, keccakf_rndc[13]);
+    KECCAK_ROUND(A, E, keccakf_rndc[14]);
+    KECCAK_ROUND(E, A, keccakf_rndc[15]);
+    KECCAK_ROUND(A, E, keccakf_rndc[16]);
+    KECCAK_ROUND(E, A, keccakf_rndc[17]);
+    KECCAK_ROUND(A, E, keccakf_rndc[18]);
+    KECCAK_ROUND(E, A, keccakf_rndc[19]);
+    KECCAK_ROUND(A, E, keccakf_rndc[20]);
+    KECCAK_ROUND(E, A, keccakf_rndc[21]);
+    KECCAK_ROUND(A, E, keccakf_rndc[22]);
+    KECCAK_ROUND(E, A, keccakf_rndc[23]);
+
+    s[0] = Aba;
+    s[1] = Abe;
+    s[2] = Abi;
+    s[3] = Abo;
+    s[4] = Abu;
+    s[5] = Aga;
+    s[6] = Age;
+    s[7] = Agi;
+    s[8] = Ago;
+    s[9] = Agu;
+    s[10] = Aka;
+    s[11] = Ake;
+    s[12] = Aki;
+    s[13] = Ako;
+    s[14] = Aku;
+    s[15] = Ama;
+    s[16] = Ame;
+    s[17] = Ami;
+    s[18] = Amo;
+    s[19] = Amu;
+    s[20] = Asa;
+    s[21] = Ase;
+    s[22] = Asi;
+    s[23] = Aso;
+    s[24] = Asu;
+    KECCAK_COMPLEMENT(s);
+}
 
-        /* Iota */
-        s[0] ^= keccakf_rndc[round];
-    }
+static uint64_t
+sha3_load64(const uint8_t *buf)
+{
+    /* endian-independent, compilers turn this into a single load */
+    return (uint64_t) (buf[0]) |
+            ((uint64_t) (buf[1]) << 8 * 1) |
+            ((uint64_t) (buf[2]) << 8 * 2) |
+            ((uint64_t) (buf[3]) << 8 * 3) |
+            ((uint64_t) (buf[4]) << 8 * 4) |
+            ((uint64_t) (buf[5]) << 8 * 5) |
+            ((uint64_t) (buf[6]) << 8 * 6) |
+            ((uint64_t) (buf[7]) << 8 * 7);
 }
 
 /* *************************** Public Inteface ************************ */
@@ -161,6 +298,7 @@ sha3_Update(void *priv, void const *bufIn, size_t len)
     size_t words;
     unsigned tail;
     size_t i;
+    unsigned rateWords;
 
     const uint8_t *buf = bufIn;
 
@@ -203,20 +341,38 @@ sha3_Update(void *priv, void const *bufIn, size_t len)
 
     SHA3_ASSERT(ctx->byteIndex == 0);
 
+    /* fill up the current block word by word, then absorb whole blocks
+     * without the per word bookkeeping */
+    rateWords = SHA3_KECCAK_SPONGE_WORDS - ctx->capacityWords;
+    while(ctx->wordIndex != 0 && len >= sizeof(uint64_t)) {
+        ctx->s[ctx->wordIndex] ^= sha3_load64(buf);
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+        if(++ctx->wordIndex == rateWords) {
+            keccakf(ctx->s);
+            ctx->wordIndex = 0;
+        }
+    }
+
+    if(ctx->wordIndex == 0) {
+        SHA3_TRACE("have %u full blocks to absorb",
+                (unsigned)(len / (rateWords * sizeof(uint64_t))));
+        while(len >= rateWords * sizeof(uint64_t)) {
+            for(i = 0; i < rateWords; i++)
+                ctx->s[i] ^= sha3_load64(buf + i * sizeof(uint64_t));
+            keccakf(ctx->s);
+            buf += rateWords * sizeof(uint64_t);
+            len -= rateWords * sizeof(uint64_t);
+        }
+    }
+
     words = len / sizeof(uint64_t);
     tail = (unsigned)(len - words * sizeof(uint64_t));
 
     SHA3_TRACE("have %u full words to process", (unsigned)words);
 
     for(i = 0; i < words; i++, buf += sizeof(uint64_t)) {
-        const uint64_t t = (uint64_t) (buf[0]) |
-                ((uint64_t) (buf[1]) << 8 * 1) |
-                ((uint64_t) (buf[2]) << 8 * 2) |
-                ((uint64_t) (buf[3]) << 8 * 3) |
-                ((uint64_t) (buf[4]) << 8 * 4) |
-                ((uint64_t) (buf[5]) << 8 * 5) |
-                ((uint64_t) (buf[6]) << 8 * 6) |
-                ((uint64_t) (buf[7]) << 8 * 7);
+        const uint64_t t = sha3_load64(buf);
 #if defined(__x86_64__ ) || defined(__i386__)
         SHA3_ASSERT(memcmp(&t, buf, 8) == 0);
 #endif
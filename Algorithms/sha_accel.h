@@ -0,0 +1,33 @@
+// public domain
+#pragma once
+
+#ifndef EXTERN_C_START
+#ifdef __cplusplus
+#define EXTERN_C_START extern "C" {
+#define EXTERN_C_END }
+#else
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+#endif
+
+EXTERN_C_START
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compress whole 64 byte blocks into a raw SHA-1 / SHA-256 state. Buffering, length counting and padding are
+// left to the caller, so these can run directly on the state of an mbedTLS context.
+typedef void sha1_blocks_fn(uint32_t state[5], const uint8_t* data, size_t blocks);
+typedef void sha256_blocks_fn(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+void sha1_blocks_shani(uint32_t state[5], const uint8_t* data, size_t blocks);
+void sha256_blocks_shani(uint32_t state[8], const uint8_t* data, size_t blocks);
+void sha1_blocks_avx2(uint32_t state[5], const uint8_t* data, size_t blocks);
+void sha256_blocks_avx2(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+// Best block function for this CPU, or NULL if nothing beats the generic C code.
+sha1_blocks_fn* sha1_get_blocks_fn(void);
+sha256_blocks_fn* sha256_get_blocks_fn(void);
+
+EXTERN_C_END
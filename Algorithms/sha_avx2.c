@@ -0,0 +1,229 @@
+// public domain
+// SHA-1 and SHA-256 for CPUs without the SHA extensions. The message schedule is computed four words at a time for
+// two blocks at once (one per 128 bit half of a YMM register), the rounds themselves stay scalar where BMI2's RORX
+// and ANDN keep the dependency chains short.
+
+#include "sha_accel.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define VROTR32(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define VROTL32(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+// Load 16 bytes of each block as big endian words, first block in the low half
+static __m256i load_be_x2(const uint8_t* b0, const uint8_t* b1)
+{
+  const __m256i bswap = _mm256_setr_epi8(
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+  );
+  const __m256i v = _mm256_inserti128_si256(
+    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)b0)),
+    _mm_loadu_si128((const __m128i*)b1),
+    1
+  );
+  return _mm256_shuffle_epi8(v, bswap);
+}
+
+static void store_x2(uint32_t* w0, uint32_t* w1, __m256i v)
+{
+  _mm_storeu_si128((__m128i*)w0, _mm256_castsi256_si128(v));
+  _mm_storeu_si128((__m128i*)w1, _mm256_extracti128_si256(v, 1));
+}
+
+// SHA-1
+
+#define SHA1_K0 0x5A827999
+#define SHA1_K1 0x6ED9EBA1
+#define SHA1_K2 0x8F1BBCDC
+#define SHA1_K3 0xCA62C1D6
+
+// W[t..t+3] = rol1(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]), with W[t] fed back into W[t+3]
+static __m256i sha1_schedule(__m256i x0, __m256i x1, __m256i x2, __m256i x3)
+{
+  __m256i t = _mm256_xor_si256(x0, _mm256_alignr_epi8(x1, x0, 8));
+  t = _mm256_xor_si256(t, x2);
+  t = _mm256_xor_si256(t, _mm256_srli_si256(x3, 4));
+  const __m256i r = VROTL32(t, 1);
+  const __m256i fix = _mm256_slli_si256(t, 12);
+  return _mm256_xor_si256(r, VROTL32(fix, 2));
+}
+
+static void sha1_schedule_x2(uint32_t wk0[80], uint32_t wk1[80], const uint8_t* b0, const uint8_t* b1)
+{
+  static const uint32_t k[4] = { SHA1_K0, SHA1_K1, SHA1_K2, SHA1_K3 };
+  __m256i x0 = load_be_x2(b0 + 0, b1 + 0);
+  __m256i x1 = load_be_x2(b0 + 16, b1 + 16);
+  __m256i x2 = load_be_x2(b0 + 32, b1 + 32);
+  __m256i x3 = load_be_x2(b0 + 48, b1 + 48);
+  for (int g = 0; g < 20; ++g)
+  {
+    store_x2(&wk0[g * 4], &wk1[g * 4], _mm256_add_epi32(x0, _mm256_set1_epi32((int)k[g / 5])));
+    const __m256i next = sha1_schedule(x0, x1, x2, x3);
+    x0 = x1;
+    x1 = x2;
+    x2 = x3;
+    x3 = next;
+  }
+}
+
+#define SHA1_F0(b, c, d) (((c ^ d) & b) ^ d)
+#define SHA1_F1(b, c, d) (b ^ c ^ d)
+#define SHA1_F2(b, c, d) ((b & c) | ((b | c) & d))
+#define SHA1_F3(b, c, d) (b ^ c ^ d)
+
+#define SHA1_ROUND(f, a, b, c, d, e, i) \
+  do { e += ROTL32(a, 5) + f(b, c, d) + wk[i]; b = ROTL32(b, 30); } while (0)
+
+#define SHA1_ROUND5(f, i) \
+  do { \
+    SHA1_ROUND(f, a, b, c, d, e, (i) + 0); \
+    SHA1_ROUND(f, e, a, b, c, d, (i) + 1); \
+    SHA1_ROUND(f, d, e, a, b, c, (i) + 2); \
+    SHA1_ROUND(f, c, d, e, a, b, (i) + 3); \
+    SHA1_ROUND(f, b, c, d, e, a, (i) + 4); \
+  } while (0)
+
+static void sha1_rounds(uint32_t state[5], const uint32_t wk[80])
+{
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 20; i += 5)
+    SHA1_ROUND5(SHA1_F0, i);
+  for (int i = 20; i < 40; i += 5)
+    SHA1_ROUND5(SHA1_F1, i);
+  for (int i = 40; i < 60; i += 5)
+    SHA1_ROUND5(SHA1_F2, i);
+  for (int i = 60; i < 80; i += 5)
+    SHA1_ROUND5(SHA1_F3, i);
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void sha1_blocks_avx2(uint32_t state[5], const uint8_t* data, size_t blocks)
+{
+  uint32_t wk0[80], wk1[80];
+  for (; blocks >= 2; blocks -= 2, data += 128)
+  {
+    sha1_schedule_x2(wk0, wk1, data, data + 64);
+    sha1_rounds(state, wk0);
+    sha1_rounds(state, wk1);
+  }
+  if (blocks)
+  {
+    sha1_schedule_x2(wk0, wk1, data, data);
+    sha1_rounds(state, wk0);
+  }
+}
+
+// SHA-256
+
+static const uint32_t k_sha256[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+  0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+  0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+  0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+  0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+  0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static __m256i sha256_sigma0(__m256i x)
+{
+  return _mm256_xor_si256(_mm256_xor_si256(VROTR32(x, 7), VROTR32(x, 18)), _mm256_srli_epi32(x, 3));
+}
+
+static __m256i sha256_sigma1(__m256i x)
+{
+  return _mm256_xor_si256(_mm256_xor_si256(VROTR32(x, 17), VROTR32(x, 19)), _mm256_srli_epi32(x, 10));
+}
+
+// W[t..t+3] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16]. The upper two words depend on the lower two.
+static __m256i sha256_schedule(__m256i x0, __m256i x1, __m256i x2, __m256i x3)
+{
+  __m256i t = _mm256_add_epi32(x0, sha256_sigma0(_mm256_alignr_epi8(x1, x0, 4)));
+  t = _mm256_add_epi32(t, _mm256_alignr_epi8(x3, x2, 4));
+  const __m256i lo = _mm256_add_epi32(t, sha256_sigma1(_mm256_shuffle_epi32(x3, 0xFE)));
+  const __m256i hi = _mm256_add_epi32(t, sha256_sigma1(_mm256_shuffle_epi32(lo, 0x40)));
+  return _mm256_blend_epi32(lo, hi, 0xCC);
+}
+
+static void sha256_schedule_x2(uint32_t wk0[64], uint32_t wk1[64], const uint8_t* b0, const uint8_t* b1)
+{
+  __m256i x0 = load_be_x2(b0 + 0, b1 + 0);
+  __m256i x1 = load_be_x2(b0 + 16, b1 + 16);
+  __m256i x2 = load_be_x2(b0 + 32, b1 + 32);
+  __m256i x3 = load_be_x2(b0 + 48, b1 + 48);
+  for (int g = 0; g < 16; ++g)
+  {
+    const __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)&k_sha256[g * 4]));
+    store_x2(&wk0[g * 4], &wk1[g * 4], _mm256_add_epi32(x0, k));
+    const __m256i next = sha256_schedule(x0, x1, x2, x3);
+    x0 = x1;
+    x1 = x2;
+    x2 = x3;
+    x3 = next;
+  }
+}
+
+#define SHA256_S0(x) (ROTR32(x, 2) ^ ROTR32(x, 13) ^ ROTR32(x, 22))
+#define SHA256_S1(x) (ROTR32(x, 6) ^ ROTR32(x, 11) ^ ROTR32(x, 25))
+#define SHA256_CH(x, y, z) ((x & y) ^ (~x & z))
+#define SHA256_MAJ(x, y, z) ((x & y) | ((x | y) & z))
+
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i) \
+  do { \
+    const uint32_t t1 = h + SHA256_S1(e) + SHA256_CH(e, f, g) + wk[i]; \
+    d += t1; \
+    h = t1 + SHA256_S0(a) + SHA256_MAJ(a, b, c); \
+  } while (0)
+
+static void sha256_rounds(uint32_t state[8], const uint32_t wk[64])
+{
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i += 8)
+  {
+    SHA256_ROUND(a, b, c, d, e, f, g, h, i + 0);
+    SHA256_ROUND(h, a, b, c, d, e, f, g, i + 1);
+    SHA256_ROUND(g, h, a, b, c, d, e, f, i + 2);
+    SHA256_ROUND(f, g, h, a, b, c, d, e, i + 3);
+    SHA256_ROUND(e, f, g, h, a, b, c, d, i + 4);
+    SHA256_ROUND(d, e, f, g, h, a, b, c, i + 5);
+    SHA256_ROUND(c, d, e, f, g, h, a, b, i + 6);
+    SHA256_ROUND(b, c, d, e, f, g, h, a, i + 7);
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void sha256_blocks_avx2(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+  uint32_t wk0[64], wk1[64];
+  for (; blocks >= 2; blocks -= 2, data += 128)
+  {
+    sha256_schedule_x2(wk0, wk1, data, data + 64);
+    sha256_rounds(state, wk0);
+    sha256_rounds(state, wk1);
+  }
+  if (blocks)
+  {
+    sha256_schedule_x2(wk0, wk1, data, data);
+    sha256_rounds(state, wk0);
+  }
+}
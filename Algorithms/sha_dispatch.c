@@ -0,0 +1,27 @@
+// public domain
+#include "sha_accel.h"
+#include "cpu_features.h"
+
+#include <stddef.h>
+
+sha1_blocks_fn* sha1_get_blocks_fn(void) {
+#if defined(CPU_FEATURES_X86)
+  const uint32_t features = cpu_get_features();
+  if ((features & (CPU_SHA | CPU_SSE41)) == (CPU_SHA | CPU_SSE41))
+    return &sha1_blocks_shani;
+  if ((features & (CPU_AVX2 | CPU_BMI2)) == (CPU_AVX2 | CPU_BMI2))
+    return &sha1_blocks_avx2;
+#endif
+  return NULL;
+}
+
+sha256_blocks_fn* sha256_get_blocks_fn(void) {
+#if defined(CPU_FEATURES_X86)
+  const uint32_t features = cpu_get_features();
+  if ((features & (CPU_SHA | CPU_SSE41)) == (CPU_SHA | CPU_SSE41))
+    return &sha256_blocks_shani;
+  if ((features & (CPU_AVX2 | CPU_BMI2)) == (CPU_AVX2 | CPU_BMI2))
+    return &sha256_blocks_avx2;
+#endif
+  return NULL;
+}
@@ -15,8 +15,10 @@
 //    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
 #define VC_EXTRALEAN
 #define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
 
 #include <Windows.h>
+#include <algorithm>
 #include <random>
 
 #include "../Algorithms/Hasher.h"
@@ -91,5 +93,63 @@ int main()
     printf("%.7lf MB/s\n", mbps);
   }
 
+  // Separate passes over each block versus tiles of it going through every context, like FileHashTask does
+  constexpr static auto k_block_size = 2ull << 20;
+  constexpr static size_t k_tile_sizes[] = { 0, 16 << 10, 32 << 10, 64 << 10 };
+  constexpr static const char* k_fused_set[] = { "CRC32", "MD5", "SHA-1", "SHA-256" };
+
+  printf("\nCRC32+MD5+SHA-1+SHA-256\n");
+
+  for (const auto tile_size : k_tile_sizes)
+  {
+    uint64_t sum = 0;
+
+    for (auto pass = 0u; pass < k_passes; ++pass)
+    {
+      HashContext* ctxs[std::size(k_fused_set)]{};
+      for (auto i = 0u; i < std::size(k_fused_set); ++i)
+        ctxs[i] = HashAlgorithm::ByName(k_fused_set[i])->MakeContext();
+
+      LARGE_INTEGER begin{}, end{};
+
+      QueryPerformanceCounter(&begin);
+
+      const auto bytes = (const uint8_t*)p;
+      for (auto offset = 0ull; offset < k_size; offset += k_block_size)
+      {
+        const auto block = bytes + offset;
+        const auto block_size = (size_t)std::min(k_size - offset, k_block_size);
+        if (tile_size == 0)
+        {
+          for (const auto ctx : ctxs)
+            ctx->Update(block, block_size);
+        }
+        else
+        {
+          for (size_t tile = 0; tile < block_size; tile += tile_size)
+            for (const auto ctx : ctxs)
+              ctx->Update(block + tile, std::min(block_size - tile, tile_size));
+        }
+      }
+
+      for (const auto ctx : ctxs)
+        (void)ctx->Finish();
+
+      QueryPerformanceCounter(&end);
+
+      for (const auto ctx : ctxs)
+        delete ctx;
+
+      sum += end.QuadPart - begin.QuadPart;
+    }
+
+    const auto mbps = (k_size * frequency.QuadPart) / (double(sum) / k_passes) / (1ull << 20); // MB/s
+
+    if (tile_size == 0)
+      printf("fan-out\t%.7lf MB/s\n", mbps);
+    else
+      printf("fused %zu KB\t%.7lf MB/s\n", tile_size >> 10, mbps);
+  }
+
   return 0;
 }
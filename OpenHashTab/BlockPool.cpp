@@ -0,0 +1,180 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#include "stdafx.h"
+
+#include "BlockPool.h"
+
+#include "utl.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+  // MEM_LARGE_PAGES needs SeLockMemoryPrivilege enabled in the token. Users only have it if an admin granted it.
+  bool EnableLockMemoryPrivilege()
+  {
+    HANDLE token{};
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+      return false;
+
+    TOKEN_PRIVILEGES tp{};
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    auto success = LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)
+      && AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr);
+    // AdjustTokenPrivileges succeeds even if we don't hold the privilege
+    success = success && GetLastError() == ERROR_SUCCESS;
+
+    CloseHandle(token);
+    return success;
+  }
+}
+
+size_t BlockPool::DefaultBudget()
+{
+  constexpr static size_t k_max_default = size_t{ 1 } << 30; // 1 GB
+
+  MEMORYSTATUSEX status{ sizeof(status) };
+  if (!GlobalMemoryStatusEx(&status))
+    return k_max_default;
+
+  return static_cast<size_t>(std::min<uint64_t>(status.ullAvailPhys / 2, k_max_default));
+}
+
+BlockPool::BlockPool(size_t block_size, size_t budget_bytes, bool large_pages)
+  : _block_size(block_size)
+  , _capacity(std::max<size_t>(1, budget_bytes / block_size))
+{
+  if (large_pages)
+  {
+    const auto large_page = GetLargePageMinimum();
+    _large_pages = large_page && block_size % large_page == 0 && EnableLockMemoryPrivilege();
+  }
+
+  _free = new uint8_t*[_capacity];
+
+  DebugMsg("BlockPool: %zu x %zu bytes, large pages %d\n", _capacity, _block_size, _large_pages);
+}
+
+uint8_t* BlockPool::Commit()
+{
+  if (_large_pages)
+  {
+    const auto p = VirtualAlloc(
+      nullptr,
+      _block_size,
+      MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+      PAGE_READWRITE
+    );
+    if (p)
+      return static_cast<uint8_t*>(p);
+
+    // Physical memory got too fragmented for large pages, no point in trying again
+    _large_pages = false;
+  }
+
+  return static_cast<uint8_t*>(VirtualAlloc(
+    nullptr,
+    _block_size,
+    MEM_RESERVE | MEM_COMMIT,
+    PAGE_READWRITE
+  ));
+}
+
+void BlockPool::Trim()
+{
+  for (size_t i = 0; i < _free_count; ++i)
+    VirtualFree(_free[i], 0, MEM_RELEASE);
+  _committed -= _free_count;
+  _free_count = 0;
+}
+
+void BlockPool::AddUser()
+{
+  AcquireSRWLockExclusive(&_lock);
+  ++_users;
+  ReleaseSRWLockExclusive(&_lock);
+}
+
+void BlockPool::RemoveUser()
+{
+  AcquireSRWLockExclusive(&_lock);
+  assert(_users);
+  if (--_users == 0)
+  {
+    DebugMsg("BlockPool: idle, freeing %zu blocks\n", _free_count);
+    Trim();
+  }
+  ReleaseSRWLockExclusive(&_lock);
+}
+
+uint8_t* BlockPool::TryAcquire()
+{
+  ++_acquires;
+
+  uint8_t* block{};
+
+  AcquireSRWLockExclusive(&_lock);
+  if (_free_count)
+  {
+    block = _free[--_free_count];
+  }
+  else if (_committed < _capacity)
+  {
+    // Under the lock so we never go over budget, this only happens while the pool is still growing
+    block = Commit();
+    if (block)
+      ++_committed;
+  }
+  if (block)
+    _peak_in_use = std::max(_peak_in_use, ++_in_use);
+  ReleaseSRWLockExclusive(&_lock);
+
+  if (!block)
+    ++_waits;
+
+  return block;
+}
+
+void BlockPool::Release(uint8_t* block)
+{
+  assert(block);
+  AcquireSRWLockExclusive(&_lock);
+  assert(_free_count < _committed);
+  _free[_free_count++] = block;
+  --_in_use;
+  // Straggler of a hash that's already over, nobody is going to want it
+  if (_users == 0)
+    Trim();
+  ReleaseSRWLockExclusive(&_lock);
+}
+
+BlockPool::Stats BlockPool::GetStats() const
+{
+  Stats stats{};
+  AcquireSRWLockShared(&_lock);
+  stats.block_size = _block_size;
+  stats.capacity = _capacity;
+  stats.committed = _committed;
+  stats.in_use = _in_use;
+  stats.peak_in_use = _peak_in_use;
+  stats.large_pages = _large_pages;
+  ReleaseSRWLockShared(&_lock);
+  stats.acquires = _acquires;
+  stats.waits = _waits;
+  return stats;
+}
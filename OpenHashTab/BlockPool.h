@@ -0,0 +1,84 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Recycles fixed size read blocks. Blocks are committed the first time the pool needs to grow, then go on a free list
+// when released, so steady state hashing does no memory syscalls at all. Growth stops at the budget, after that
+// TryAcquire() fails until something is released. Once the last user is gone the blocks are given back to the system,
+// we live in explorer and shouldn't sit on a gigabyte of memory between two hashes.
+class BlockPool
+{
+public:
+  struct Stats
+  {
+    size_t block_size;
+    size_t capacity;      // budget in blocks
+    size_t committed;     // blocks allocated so far
+    size_t in_use;        // blocks handed out right now
+    size_t peak_in_use;
+    uint64_t acquires;
+    uint64_t waits;       // failed acquires, each one a file sent back to the read queue
+    bool large_pages;
+  };
+
+  // block_size must be a multiple of the large page size for large_pages to have any effect
+  BlockPool(size_t block_size, size_t budget_bytes, bool large_pages);
+
+  // Never freed, blocks may be in flight until process exit
+  ~BlockPool() = delete;
+
+  BlockPool(const BlockPool&) = delete;
+  BlockPool(BlockPool&&) = delete;
+  BlockPool& operator=(const BlockPool&) = delete;
+  BlockPool& operator=(BlockPool&&) = delete;
+
+  // Whoever is about to hash files, for as long as they do
+  void AddUser();
+  void RemoveUser();
+
+  uint8_t* TryAcquire();
+
+  void Release(uint8_t* block);
+
+  Stats GetStats() const;
+
+  // Half of the available physical memory, but no more than the 1 GB we always used to allow
+  static size_t DefaultBudget();
+
+private:
+  size_t _block_size;
+  size_t _capacity;
+  bool _large_pages{};
+
+  mutable SRWLOCK _lock = SRWLOCK_INIT;
+  uint8_t** _free{};    // stack of _capacity entries
+  size_t _free_count{};
+  size_t _committed{};
+  size_t _in_use{};
+  size_t _peak_in_use{};
+  size_t _users{};
+
+  std::atomic<uint64_t> _acquires{};
+  std::atomic<uint64_t> _waits{};
+
+  uint8_t* Commit();
+
+  // Gives every block on the free list back to the system. Called with the lock held.
+  void Trim();
+};
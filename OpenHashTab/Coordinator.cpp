@@ -21,8 +21,11 @@
 #include "wnd.h"
 #include "Settings.h"
 #include "FileHashTask.h"
+#include "BlockPool.h"
 
+#include <algorithm>
 #include <cassert>
+#include <vector>
 
 Coordinator::Coordinator(std::list<std::wstring> files)
   : _files_raw(std::move(files)) {}
@@ -88,6 +91,117 @@ void Coordinator::AddFiles()
     AddFile(file.first, file.second);
 }
 
+VOID NTAPI Coordinator::AdmitCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx
+)
+{
+  UNREFERENCED_PARAMETER(instance);
+  static_cast<FileHashTask*>(ctx)->StartProcessing();
+}
+
+bool Coordinator::IsPriority(const FileHashTask* file) const
+{
+  if (_cached_first)
+    return file->IsResident();
+  return _hybrid && file->GetSize() <= k_priority_file_size;
+}
+
+size_t Coordinator::TakeAdmissible(FileHashTask** files, size_t max_count)
+{
+  auto count = 0u;
+  while (count < max_count && _active_priority + _active_bulk < _window_size)
+  {
+    if (!_queued_priority.empty())
+    {
+      const auto file = _queued_priority.front();
+      _queued_priority.pop_front();
+      file->SetAdmittedPriority(true);
+      files[count++] = file;
+      ++_active_priority;
+    }
+    else if (!_queued_bulk.empty() && _active_bulk < _bulk_slots)
+    {
+      const auto file = _queued_bulk.front();
+      _queued_bulk.pop_front();
+      ++_bulk_taken;
+      // Found in the cache while waiting, it was let in from the priority queue already. Asked directly, the size the
+      // hybrid policy goes by may have changed since the file was queued if it was opened ahead.
+      if (file->IsResident())
+        continue;
+      file->SetAdmittedPriority(false);
+      files[count++] = file;
+      ++_active_bulk;
+    }
+    else
+    {
+      break;
+    }
+  }
+  return count;
+}
+
+void Coordinator::PrefetchQueued()
+{
+  // Files already opening or open just ignore it
+  for (auto i = 0u; i < k_open_ahead && i < _queued_priority.size(); ++i)
+    _queued_priority[i]->Prefetch();
+  for (auto i = 0u; i < k_open_ahead && i < _queued_bulk.size(); ++i)
+    _queued_bulk[i]->Prefetch();
+}
+
+VOID NTAPI Coordinator::ProbeCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx
+)
+{
+  CallbackMayRunLong(instance);
+  static_cast<Coordinator*>(ctx)->ProbeResidency();
+}
+
+void Coordinator::ProbeResidency()
+{
+  auto misses = 0u;
+  for (size_t i = 0; misses < k_probe_max_misses; ++i)
+  {
+    FileHashTask* file;
+    {
+      std::lock_guard<std::mutex> guard{ _admission_mutex };
+      // Skip whatever got let in while we were busy, i is the position in the bulk queue as it was at the start
+      i = std::max(i, _bulk_taken);
+      if (i - _bulk_taken >= _queued_bulk.size())
+        break;
+      file = _queued_bulk[i - _bulk_taken];
+    }
+
+    const auto result = file->ProbeCached();
+    if (result == FileHashTask::Probe_Uncached)
+      ++misses;
+    if (result != FileHashTask::Probe_Cached)
+      continue;
+    misses = 0;
+
+    FileHashTask* start[1];
+    size_t count;
+    {
+      std::lock_guard<std::mutex> guard{ _admission_mutex };
+      if (i < _bulk_taken)
+        continue;
+      // Its entry in the bulk queue stays, it's skipped once it gets to the front
+      file->SetResident();
+      _queued_priority.push_back(file);
+      count = TakeAdmissible(start, std::size(start));
+      PrefetchQueued();
+    }
+
+    // Slots kept for priority files may be free right now
+    if (count && !TrySubmitThreadpoolCallback(AdmitCallback, start[0], nullptr))
+      start[0]->StartProcessing();
+  }
+
+  Dereference();
+}
+
 void Coordinator::ProcessFiles()
 {
   // We have 0 files, oops!
@@ -96,11 +210,66 @@ void Coordinator::ProcessFiles()
     SendNotifyMessageW(_window, wnd::WM_USER_ALL_FILES_FINISHED, wnd::k_user_magic_wparam, 0);
     return;
   }
+
+  const auto policy = settings.schedule_policy.Get();
+  const auto window_size = settings.active_files.Get();
+  _window_size = window_size ? window_size : UINT_MAX;
+  _hybrid = policy == Schedule_Hybrid;
+  _cached_first = policy == Schedule_CachedFirst;
+  _bulk_slots = _hybrid || _cached_first ? _window_size - std::max(1u, _window_size / 4) : _window_size;
+  if (_bulk_slots == 0)
+    _bulk_slots = 1; // a window of 1 would never let a bulk file in
+
+  // Until the last file is done, see FileCompletionCallback()
+  FileHashTask::GetBlockPool()->AddUser();
+
+  // Files aren't open yet, so there's no layout key to go by. Path order keeps a directory together, which is
+  // usually close to how it's laid out on the disk. Device queues of rotational disks sort the open files properly.
+  std::vector<FileHashTask*> order;
+  order.reserve(_file_tasks.size());
   for (const auto& task : _file_tasks)
+    order.push_back(task.get());
+  // Priority files go first and smallest first, they're split off into their own queue anyways
+  std::stable_sort(order.begin(), order.end(), [&](const FileHashTask* a, const FileHashTask* b)
   {
-    ++_files_not_finished;
-    task->StartProcessing();
+    if (policy == Schedule_SmallestFirst)
+      return a->GetSize() < b->GetSize();
+    const auto a_priority = IsPriority(a);
+    const auto b_priority = IsPriority(b);
+    if (a_priority != b_priority)
+      return a_priority;
+    if (a_priority)
+      return a->GetSize() < b->GetSize();
+    return a->GetPath() < b->GetPath();
+  });
+
+  std::vector<FileHashTask*> start(order.size());
+  size_t count;
+  {
+    std::lock_guard<std::mutex> guard{ _admission_mutex };
+    for (const auto task : order)
+      (IsPriority(task) ? _queued_priority : _queued_bulk).push_back(task);
+    count = TakeAdmissible(start.data(), start.size());
+    PrefetchQueued();
+  }
+
+  // All of them up front, files finishing right away must not look like the last one
+  _files_not_finished = static_cast<unsigned>(order.size());
+
+  // Nothing is known to be cached before the probe got to it, it starts out with everything in the bulk queue.
+  // Keeps us alive until it's done, it might still be probing when the last file finishes.
+  if (_cached_first)
+  {
+    Reference();
+    if (!TrySubmitThreadpoolCallback(ProbeCallback, this, nullptr))
+      Dereference();
   }
+
+  // Opening the first window shouldn't keep the caller waiting either
+  for (auto i = 0u; i < count; ++i)
+    start[i]->Prefetch();
+  for (auto i = 0u; i < count; ++i)
+    start[i]->StartProcessing();
 }
 
 void Coordinator::Cancel(bool wait)
@@ -115,6 +284,21 @@ void Coordinator::Cancel(bool wait)
 
 void Coordinator::FileCompletionCallback(FileHashTask* file)
 {
+  FileHashTask* next[1];
+  size_t count;
+  {
+    std::lock_guard<std::mutex> guard{ _admission_mutex };
+    // Not asked again, the file may have been opened with a different size since it was let in
+    --(file->IsAdmittedPriority() ? _active_priority : _active_bulk);
+    count = TakeAdmissible(next, std::size(next));
+    PrefetchQueued();
+  }
+
+  // Might be called from a file that finished right in StartProcessing(), a fresh stack keeps a long queue of those
+  // from recursing
+  if (count && !TrySubmitThreadpoolCallback(AdmitCallback, next[0], nullptr))
+    next[0]->StartProcessing();
+
   std::lock_guard<std::mutex> guard{ _window_mutex };
 
   const auto not_finished = --_files_not_finished;
@@ -125,17 +309,70 @@ void Coordinator::FileCompletionCallback(FileHashTask* file)
     if (not_finished == 0)
       SendNotifyMessageW(_window, wnd::WM_USER_ALL_FILES_FINISHED, wnd::k_user_magic_wparam, 0);
   }
+
+  if (not_finished == 0)
+  {
+    const auto stats = FileHashTask::GetBlockPool()->GetStats();
+    DebugMsg(
+      "BlockPool: %zu/%zu committed, %zu in use, peak %zu, %llu acquires, %llu waits\n",
+      stats.committed,
+      stats.capacity,
+      stats.in_use,
+      stats.peak_in_use,
+      stats.acquires,
+      stats.waits
+    );
+    FileHashTask::GetBlockPool()->RemoveUser();
+  }
+}
+
+void Coordinator::FileWaitingOnDevice(FileHashTask* file, bool waiting)
+{
+  FileHashTask* next[1];
+  size_t count;
+  {
+    std::lock_guard<std::mutex> guard{ _admission_mutex };
+    auto& active = file->IsAdmittedPriority() ? _active_priority : _active_bulk;
+    if (!waiting)
+    {
+      ++active;
+      return;
+    }
+    --active;
+    // No opening ahead from here, that might open a file right here and start it on this same device. The next
+    // completion catches up on it.
+    count = TakeAdmissible(next, std::size(next));
+  }
+
+  // Starting it right here could end up in the device queue whose lock we're called with
+  if (count == 0 || TrySubmitThreadpoolCallback(AdmitCallback, next[0], nullptr))
+    return;
+
+  // Put it back, it goes with the next file that frees a slot
+  std::lock_guard<std::mutex> guard{ _admission_mutex };
+  if (next[0]->IsAdmittedPriority())
+  {
+    --_active_priority;
+    _queued_priority.push_front(next[0]);
+  }
+  else
+  {
+    --_active_bulk;
+    --_bulk_taken;
+    _queued_bulk.push_front(next[0]);
+  }
 }
 
 void Coordinator::FileProgressCallback(uint64_t size_progress)
 {
-  if (_size_total == 0)
+  const auto size_total = _size_total.load();
+  if (size_total == 0)
     return;
 
   const auto old_progress = _size_progressed.fetch_add(size_progress);
   const auto new_progress = old_progress + size_progress;
-  const auto old_part = old_progress * k_progress_resolution / _size_total;
-  const auto new_part = new_progress * k_progress_resolution / _size_total;
+  const auto old_part = old_progress * k_progress_resolution / size_total;
+  const auto new_part = new_progress * k_progress_resolution / size_total;
 
   if(old_part != new_part)
   {
@@ -150,6 +387,12 @@ void Coordinator::FileProgressCallback(uint64_t size_progress)
   }
 }
 
+void Coordinator::FileSizeChanged(uint64_t old_size, uint64_t new_size)
+{
+  // Wraps around for a file that shrank, which is just what we want
+  _size_total += new_size - old_size;
+}
+
 std::pair<std::wstring, std::wstring> Coordinator::GetSumfileDefaultSavePathAndBaseName()
 {
   std::wstring name{ L"checksums" };
@@ -17,6 +17,7 @@
 #include "path.h"
 #include "Settings.h"
 
+#include <deque>
 #include <mutex>
 
 class FileHashTask;
@@ -26,11 +27,30 @@ class Coordinator
 public:
   constexpr static auto k_progress_resolution = 256u;
 
+  // Order files are let in to hash, see Settings::schedule_policy
+  enum SchedulePolicy : DWORD
+  {
+    Schedule_Throughput,    // by path, device queues of disks then go in physical order
+    Schedule_SmallestFirst,
+    Schedule_Hybrid,        // part of the window is kept for small files, large ones go in disk order
+    Schedule_CachedFirst    // like hybrid, but for files found in the file cache instead of small ones
+  };
+
+  // Probing stops after this many files in a row weren't cached, each of those cost a read
+  constexpr static unsigned k_probe_max_misses = 8;
+
+  // Files fitting in a single read block get the priority slots of the hybrid policy
+  constexpr static uint64_t k_priority_file_size = 2 << 20;
+
+  // Files at the front of each queue are opened this far ahead of being let in, so opening them doesn't hold up the
+  // window. Everything else stays closed until then.
+  constexpr static size_t k_open_ahead = 16;
+
 private:
   std::list<std::wstring> _files_raw;
   ProcessedFileList _files{};
   HWND _window{};
-  uint64_t _size_total{};
+  std::atomic<uint64_t> _size_total{};
   std::atomic<uint64_t> _size_progressed{};
   std::list<std::unique_ptr<FileHashTask>> _file_tasks;
   std::mutex _window_mutex{};
@@ -38,8 +58,45 @@ private:
   std::atomic<unsigned> _files_not_finished{};
   bool _is_sumfile{};
 
+  // Only so many files are active at once, the rest wait here for a slot in the window. Files waiting on their device
+  // don't count, see FileWaitingOnDevice(). Priority files can have any
+  // slot, the bulk only some of them: small files with the hybrid policy, cached ones with cached first.
+  std::mutex _admission_mutex{};
+  std::deque<FileHashTask*> _queued_priority{};
+  std::deque<FileHashTask*> _queued_bulk{};
+  size_t _bulk_taken{}; // files ever taken from the front of _queued_bulk
+  unsigned _active_priority{};
+  unsigned _active_bulk{};
+  unsigned _window_size{};
+  unsigned _bulk_slots{};
+  bool _hybrid{};
+  bool _cached_first{};
+
+  static VOID NTAPI AdmitCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx
+  );
+
   void AddFile(const std::wstring& path, const ProcessedFileList::FileInfo& fi);
 
+  bool IsPriority(const FileHashTask* file) const;
+
+  // Call with _admission_mutex held. Returns the files that may start now.
+  size_t TakeAdmissible(FileHashTask** files, size_t max_count);
+
+  // Call with _admission_mutex held
+  void PrefetchQueued();
+
+  static VOID NTAPI ProbeCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx
+  );
+
+  // Walks the bulk queue ahead of admission, moving files found in the file cache up to the priority queue. Those
+  // hash at memory speed, so they go first while the rest streams from the disk. Gives up after a run of
+  // files that weren't.
+  void ProbeResidency();
+
 public:
   Coordinator(std::list<std::wstring> files);
   virtual ~Coordinator();
@@ -56,6 +113,15 @@ public:
   void FileCompletionCallback(FileHashTask* file);
   void FileProgressCallback(uint64_t size_progress);
 
+  // The file's device queue left it waiting, or started it after all. While it waits it gives its slot in the window
+  // to the next file, so files on a slow device can't fill the window and keep those on a faster one from starting.
+  // One that's started takes its slot back even if the window is full, devices only start so many at once anyways.
+  // Called with the device queue's lock held.
+  void FileWaitingOnDevice(FileHashTask* file, bool waiting);
+
+  // The file was a different size by the time it was opened, and is hashed with the new one
+  void FileSizeChanged(uint64_t old_size, uint64_t new_size);
+
   // The window should probably only inspect files before processing or after all are done
   const std::list<std::unique_ptr<FileHashTask>>& GetFiles() const { return _file_tasks; }
   bool IsSumfile() const { return _is_sumfile; }
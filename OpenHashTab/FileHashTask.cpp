@@ -17,59 +17,72 @@
 
 #include "FileHashTask.h"
 
+#include "BlockPool.h"
 #include "Coordinator.h"
+#include "IoRing.h"
 #include "Queues.h"
 #include "utl.h"
+#include "../Algorithms/HashScheduler.h"
+#include "../Algorithms/MultiBuffer.h"
 
-std::atomic<intptr_t> FileHashTask::s_allocations_remaining = k_max_allocations;
+#include <winioctl.h>
 
-uint8_t* FileHashTask::BlockTryAllocate()
+BlockPool* FileHashTask::GetBlockPool()
 {
-  if (--s_allocations_remaining >= 0)
+  static const auto pool = []
   {
-    const auto p = VirtualAlloc(
-      nullptr,
-      k_block_size,
-      MEM_RESERVE | MEM_COMMIT,
-      PAGE_READWRITE
-    );
+    const Settings settings;
+    // Increasing the budget will increase memory use and reduce
+    // possibility of a slower disk clogging up the queue
+    const auto budget_mb = settings.block_budget_mb.Get();
+    auto budget = budget_mb ? static_cast<size_t>(budget_mb) << 20 : BlockPool::DefaultBudget();
+    // Every block can be a read in flight, and the I/O ring has to have room for all of their completions
+    budget = std::min<size_t>(budget, static_cast<size_t>(IoRingReader::k_completion_queue_size) * k_block_size);
+    return new BlockPool(k_block_size, budget, settings.large_pages);
+  }();
+  return pool;
+}
 
-    if (p)
-      return static_cast<uint8_t*>(p);
-  }
+uint8_t* FileHashTask::BlockTryAllocate()
+{
+  return GetBlockPool()->TryAcquire();
+}
 
-  ++s_allocations_remaining;
-  return nullptr;
+void FileHashTask::BlockFree(uint8_t* p)
+{
+  GetBlockPool()->Release(p);
 }
 
-void FileHashTask::BlockReset(uint8_t* p)
+const uint8_t* FileHashTask::GetZeroBlock()
 {
-  VirtualAlloc(
-    p,
+  static const auto block = static_cast<const uint8_t*>(VirtualAlloc(
+    nullptr,
     k_block_size,
-    MEM_RESET,
-    PAGE_READWRITE
-  );
-  // We don't care about errors
+    MEM_COMMIT | MEM_RESERVE,
+    PAGE_READONLY
+  ));
+  return block;
 }
 
-void FileHashTask::BlockFree(uint8_t* p)
+HashScheduler* FileHashTask::GetScheduler(unsigned thread_count)
 {
-  const auto ret = VirtualFree(p, 0, MEM_RELEASE);
-  (void)ret;
-  assert(ret);
-  ++s_allocations_remaining;
+  static const auto scheduler = [thread_count]
+  {
+    // Workers live until the process exits, so we must not get unloaded under them
+    HMODULE self{};
+    GetModuleHandleExW(
+      GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+      reinterpret_cast<LPCWSTR>(&GetScheduler),
+      &self
+    );
+    return new HashScheduler(thread_count);
+  }();
+  return scheduler;
 }
 
-VOID NTAPI FileHashTask::HashWorkCallback(
-  _Inout_     PTP_CALLBACK_INSTANCE instance,
-  _Inout_opt_ PVOID                 ctx,
-  _Inout_     PTP_WORK              work
-)
+void FileHashTask::HashJob(void* ctx, size_t ctx_index)
 {
-  UNREFERENCED_PARAMETER(instance);
-  UNREFERENCED_PARAMETER(work);
-  static_cast<FileHashTask*>(ctx)->DoHashRound();
+  static_cast<FileHashTask*>(ctx)->DoHashRound(ctx_index);
 }
 
 VOID WINAPI FileHashTask::IoCallback(
@@ -82,9 +95,183 @@ VOID WINAPI FileHashTask::IoCallback(
 )
 {
   UNREFERENCED_PARAMETER(instance);
-  UNREFERENCED_PARAMETER(overlapped);
+  UNREFERENCED_PARAMETER(ctx);
   UNREFERENCED_PARAMETER(io);
-  static_cast<FileHashTask*>(ctx)->OverlappedCompletionRoutine(result, bytes_transferred);
+  const auto slot = CONTAINING_RECORD(overlapped, ReadSlot, overlapped);
+  slot->task->ReadCompleted(slot, result, bytes_transferred);
+}
+
+VOID NTAPI FileHashTask::MultiBufferDrainCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx
+)
+{
+  // A drainer keeps going for as long as files keep feeding it
+  CallbackMayRunLong(instance);
+  static_cast<MultiBufferHasher*>(ctx)->Drain();
+}
+
+void FileHashTask::MultiBufferCompletion(void* param)
+{
+  const auto [task, ctx_index] = FromLparam(reinterpret_cast<LPARAM>(param));
+  task->FinishMultiBuffer(ctx_index);
+}
+
+namespace
+{
+  // The right half of a fork. Whoever claims it first runs it: a worker, or the forking thread itself once it's done
+  // with the left half. Two references because the losing worker callback still touches it after the fork returned.
+  struct ParallelJoinRight
+  {
+    void (*task)(void*);
+    void* arg;
+    std::atomic<int> refs{ 2 };
+    std::atomic<bool> claimed{};
+    bool done{};
+    SRWLOCK lock = SRWLOCK_INIT;
+    CONDITION_VARIABLE cv = CONDITION_VARIABLE_INIT;
+
+    void Release()
+    {
+      if (--refs == 0)
+        delete this;
+    }
+  };
+}
+
+VOID NTAPI FileHashTask::ParallelJoinCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx
+)
+{
+  UNREFERENCED_PARAMETER(instance);
+  const auto right = static_cast<ParallelJoinRight*>(ctx);
+  if (!right->claimed.exchange(true))
+  {
+    right->task(right->arg);
+    AcquireSRWLockExclusive(&right->lock);
+    right->done = true;
+    ReleaseSRWLockExclusive(&right->lock);
+    WakeConditionVariable(&right->cv);
+  }
+  right->Release();
+}
+
+void FileHashTask::ParallelJoin(void (*task)(void*), void* left, void* right)
+{
+  const auto fork = new ParallelJoinRight{ task, right };
+  if (!TrySubmitThreadpoolCallback(ParallelJoinCallback, fork, nullptr))
+  {
+    delete fork;
+    task(left);
+    task(right);
+    return;
+  }
+
+  task(left);
+
+  // If no worker picked it up yet we are the best candidate anyways, the data is still hot in our cache
+  if (!fork->claimed.exchange(true))
+  {
+    task(right);
+  }
+  else
+  {
+    AcquireSRWLockExclusive(&fork->lock);
+    while (!fork->done)
+      SleepConditionVariableSRW(&fork->cv, &fork->lock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&fork->lock);
+  }
+  fork->Release();
+}
+
+namespace
+{
+  int InPageErrorFilter(const EXCEPTION_POINTERS* pointers, DWORD* error)
+  {
+    const auto record = pointers->ExceptionRecord;
+    if (record->ExceptionCode != EXCEPTION_IN_PAGE_ERROR)
+      return EXCEPTION_CONTINUE_SEARCH;
+    // The third parameter is the status the page failed to come in with
+    *error = record->NumberParameters >= 3
+      ? RtlNtStatusToDosError(static_cast<NTSTATUS>(record->ExceptionInformation[2]))
+      : ERROR_READ_FAULT;
+    return EXCEPTION_EXECUTE_HANDLER;
+  }
+
+  // A view can't fail a read like ReadFile does, touching a page that can't be read raises an in-page error instead.
+  // Bad sectors and lost network connections end up here. Returns the error the read would have failed with.
+  DWORD GuardedUpdate(HashContext* ctx, const uint8_t* data, size_t size)
+  {
+    DWORD error = ERROR_SUCCESS;
+    __try
+    {
+      ctx->Update(data, size);
+    }
+    __except (InPageErrorFilter(GetExceptionInformation(), &error))
+    {
+    }
+    return error;
+  }
+
+  // Pages brought in by this thread while it's alive are put on the standby list with a very low priority, so they
+  // are repurposed before anyone else's. Works for cache misses during our reads, and read-ahead done for them.
+  class LowPagePriority
+  {
+    PAGE_PRIORITY_INFORMATION _old{};
+    bool _set{};
+
+  public:
+    explicit LowPagePriority(bool enable)
+    {
+      if (!enable)
+        return;
+      if (!NT_SUCCESS(NtQueryInformationThread(NtCurrentThread(), ThreadPagePriority, &_old, sizeof(_old), nullptr)))
+        return;
+      PAGE_PRIORITY_INFORMATION low{ 1 }; // MEMORY_PRIORITY_VERY_LOW
+      _set = NT_SUCCESS(NtSetInformationThread(NtCurrentThread(), ThreadPagePriority, &low, sizeof(low)));
+    }
+
+    ~LowPagePriority()
+    {
+      if (_set)
+        NtSetInformationThread(NtCurrentThread(), ThreadPagePriority, &_old, sizeof(_old));
+    }
+
+    LowPagePriority(const LowPagePriority&) = delete;
+    LowPagePriority& operator=(const LowPagePriority&) = delete;
+  };
+
+  void PrefetchView(void* view, size_t size)
+  {
+    struct xWIN32_MEMORY_RANGE_ENTRY
+    {
+      PVOID VirtualAddress;
+      SIZE_T NumberOfBytes;
+    };
+    using fn_t = BOOL WINAPI(HANDLE, ULONG_PTR, xWIN32_MEMORY_RANGE_ENTRY*, ULONG);
+
+    // Windows 8 and up, without it the pages only come in once they're touched
+    static const auto pfn = reinterpret_cast<fn_t*>(
+      GetProcAddress(GetModuleHandleW(L"kernel32"), "PrefetchVirtualMemory"));
+    if (!pfn)
+      return;
+
+    xWIN32_MEMORY_RANGE_ENTRY range{ view, size };
+    pfn(GetCurrentProcess(), 1, &range, 0);
+  }
+}
+
+IoRingReader* FileHashTask::GetIoRing()
+{
+  static const auto ring = IoRingReader::Create(&IoRingCompletion);
+  return ring;
+}
+
+void FileHashTask::IoRingCompletion(void* user_data, DWORD error, size_t bytes_transferred)
+{
+  const auto slot = static_cast<ReadSlot*>(user_data);
+  slot->task->ReadCompleted(slot, error, bytes_transferred);
 }
 
 void FileHashTask::ProcessReadQueue(uint8_t* reuse_block)
@@ -95,32 +282,180 @@ void FileHashTask::ProcessReadQueue(uint8_t* reuse_block)
     auto ret = g_read_queue.try_dequeue(waiting_for_read);
     if (!ret)
       break;
-    ret = waiting_for_read->ReadBlockAsync(reuse_block);
-    reuse_block = nullptr;
+    // Reads on the ring are batched up and submitted in one go after the loop
+    AcquireSRWLockExclusive(&waiting_for_read->_read_lock);
+    ret = waiting_for_read->Pump(reuse_block, false);
     if (!ret)
       break;
   }
   while (true);
+  if (const auto ring = GetIoRing())
+    ring->Submit();
   if (reuse_block)
     BlockFree(reuse_block);
 }
 
+VOID NTAPI FileHashTask::SmallFileDrainCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx
+)
+{
+  CallbackMayRunLong(instance);
+  DrainSmallFiles(static_cast<DeviceQueue*>(ctx));
+}
+
+void FileHashTask::DrainSmallFiles(DeviceQueue* device)
+{
+  // Lives as long as the drainer, not per file or per batch
+  const auto buffer = static_cast<uint8_t*>(VirtualAlloc(
+    nullptr,
+    k_small_batch_size,
+    MEM_COMMIT | MEM_RESERVE,
+    PAGE_READWRITE
+  ));
+  const auto setup_error = !buffer ? GetLastError() : ERROR_SUCCESS;
+
+  // Taken the first time a file wants the algorithm, cleared between files and given back when we're done
+  HashContext* contexts[HashAlgorithm::k_count]{};
+
+  FileHashTask* batch[k_small_batch_files];
+  size_t offsets[k_small_batch_files];
+  OVERLAPPED overlapped[k_small_batch_files];
+  bool started[k_small_batch_files];
+
+  while (true)
+  {
+    const auto count = device->TakeSmallBatch(batch, std::size(batch));
+    if (count == 0)
+      break;
+
+    // Start reading the whole batch at once, each file gets the next slice of the buffer
+    size_t offset = 0;
+    for (auto i = 0u; i < count; ++i)
+    {
+      const auto file = batch[i];
+      offsets[i] = offset;
+      started[i] = false;
+      // Whatever it failed with before getting here stays
+      if (file->_error == ERROR_SUCCESS)
+      {
+        if (file->_cancelled)
+          file->_error = ERROR_CANCELLED;
+        else if (setup_error != ERROR_SUCCESS)
+          file->_error = setup_error;
+        else
+          file->_error = file->StartSmallRead(buffer + offset, overlapped[i]);
+        started[i] = file->_error == ERROR_SUCCESS;
+      }
+      offset += static_cast<size_t>(file->_file_size);
+    }
+
+    for (auto i = 0u; i < count; ++i)
+      if (started[i])
+        batch[i]->_error = batch[i]->FinishSmallRead(overlapped[i]);
+
+    for (auto i = 0u; i < count; ++i)
+    {
+      const auto file = batch[i];
+      if (file->_error == ERROR_SUCCESS)
+      {
+        const auto data = buffer + offsets[i];
+        const auto size = static_cast<size_t>(file->_file_size);
+        for (auto j = 0u; j < HashAlgorithm::k_count; ++j)
+        {
+          if (!file->_prop_page->settings.algorithms[j])
+            continue;
+          auto& ctx = contexts[j];
+          if (!ctx)
+            ctx = HashAlgorithm::g_hashers[j].AcquireContext();
+          ctx->Update(data, size);
+          file->_hash_results[j] = ctx->Finish();
+          ctx->Clear();
+        }
+        if (size)
+          file->_prop_page->FileProgressCallback(size);
+      }
+      file->Finish();
+    }
+  }
+
+  for (const auto ctx : contexts)
+    if (ctx)
+      HashAlgorithm::ReleaseContext(ctx);
+  if (buffer)
+    VirtualFree(buffer, 0, MEM_RELEASE);
+}
+
 FileHashTask::FileHashTask(Coordinator* prop_page, const std::wstring& path, const ProcessedFileList::FileInfo& file_info)
   : _hash_contexts{}
   , _prop_page{ prop_page }
   , _file_info{ file_info }
+  , _path{ path }
 {
   // Instead of exception, set _error because a failed file is still a finished
   // file task. Finish mechanism will trigger on first block read
 
+  auto enabled_count = 0u;
   for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
   {
     _lparam_idx[i] = static_cast<uint8_t>(i);
     if (_prop_page->settings.algorithms[i])
-      _hash_contexts[i].reset(HashAlgorithm::g_hashers[i].MakeContext());
+      ++enabled_count;
+  }
+
+  for (auto& slot : _read_slots)
+    slot.task = this;
+
+  _read_depth = 1 + std::min<DWORD>(_prop_page->settings.read_ahead, static_cast<DWORD>(k_read_slots - 1));
+
+  // Tiling only pays off when there's more than one pass to save
+  _fused = _prop_page->settings.fused_update && enabled_count > 1;
+
+  // Every enabled algorithm consumes blocks at its own pace. Fused mode has a single consumer doing all of them, and
+  // with nothing enabled a lone consumer still has to walk the file.
+  if (_fused || enabled_count == 0)
+    _is_consumer[0] = true;
+  else
+    for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
+      _is_consumer[i] = _prop_page->settings.algorithms[i];
+
+  // Just the size for now, without holding on to a handle. The file is opened once it's about to be hashed.
+  WIN32_FILE_ATTRIBUTE_DATA fad;
+  if (!GetFileAttributesExW(utl::MakePathLongCompatible(path).c_str(), GetFileExInfoStandard, &fad))
+  {
+    _error = GetLastError();
+    return;
   }
 
-  _handle = utl::OpenForRead(path, true);
+  _file_size = static_cast<uint64_t>(fad.nFileSizeHigh) << 32 | fad.nFileSizeLow;
+}
+
+void FileHashTask::Open()
+{
+  // Already failed the stat, or no one wants the result anymore
+  if (_error != ERROR_SUCCESS)
+    return;
+
+  if (_cancelled)
+  {
+    _error = ERROR_CANCELLED;
+    return;
+  }
+
+  // Small files are packed into a shared buffer without any alignment, and don't weigh much on the cache anyways.
+  // Whether this one is small is only known for sure once it's open, but the stat is a good enough guess for how
+  // to open it.
+  const auto cache_policy = _prop_page->settings.cache_policy.Get();
+  const auto direct = cache_policy == Cache_Direct && _file_size > k_small_file_size;
+  _drop_behind = cache_policy == Cache_DropBehind;
+
+  DWORD flags = 0;
+  if (direct)
+    flags = FILE_FLAG_NO_BUFFERING;
+  else if (_drop_behind)
+    flags = FILE_FLAG_SEQUENTIAL_SCAN;
+
+  _handle = utl::OpenForRead(_path, true, flags);
 
   if(_handle == INVALID_HANDLE_VALUE)
   {
@@ -135,24 +470,89 @@ FileHashTask::FileHashTask(Coordinator* prop_page, const std::wstring& path, con
     return;
   }
 
-  _file_size = static_cast<uint64_t>(fi.nFileSizeHigh) << 32 | fi.nFileSizeLow;
-  _file_index = static_cast<uint64_t>(fi.nFileIndexHigh) << 32 | fi.nFileIndexLow;
+  // It may have been a while since the stat, what we hash is what the file is now. Scheduling already went by the
+  // old size, only the progress total is set straight.
+  const auto size = static_cast<uint64_t>(fi.nFileSizeHigh) << 32 | fi.nFileSizeLow;
+  if (size != _file_size)
+  {
+    _prop_page->FileSizeChanged(_file_size, size);
+    _file_size = size;
+  }
 
-  // TODO: use this in queue so a lot of files from a slower device can't slow down another faster device
-  _volume_serial = fi.dwVolumeSerialNumber;
+  // Not worth a threadpool I/O object, let alone a whole block. Only marked as such once it's open, a file that
+  // failed has no business in the small file batches. One that shrank after being opened unbuffered can't be read
+  // into a batch, it stays on the block path.
+  const auto small = _file_size <= k_small_file_size && !direct;
 
-  _threadpool_hash_work = CreateThreadpoolWork(
-    HashWorkCallback,
-    this,
-    nullptr
-  );
+  _file_index = static_cast<uint64_t>(fi.nFileIndexHigh) << 32 | fi.nFileIndexLow;
+  _volume_serial = fi.dwVolumeSerialNumber;
 
-  if (!_threadpool_hash_work)
+  // Nothing left to do, not even taking a turn on the device
+  if (LookupCache())
   {
-    _error = GetLastError();
+    _from_cache = true;
+    return;
+  }
+
+  // An empty file is still read once, that's what gets its hashing started
+  _block_count = std::max<uint64_t>(1, (_file_size + k_block_size - 1) / k_block_size);
+
+  // Files on a slower device can't slow down another faster device, each device has its own queue
+  _device = DeviceQueue::ForVolume(_volume_serial, _path);
+
+  // Reading in physical order saves a lot of seeking on disks, on anything else it's not worth the extra call
+  if (_prop_page->settings.layout_order && _device->GetKind() == DeviceQueue::Kind::Rotational)
+    _layout_key = DeviceQueue::LayoutKey(_handle, _file_index);
+
+  // Small files are read by the device's drainers, none of the rest is for them
+  _small = small;
+  if (_small)
     return;
+
+  if (direct)
+  {
+    struct xFILE_STORAGE_INFO
+    {
+      ULONG LogicalBytesPerSector;
+      ULONG PhysicalBytesPerSectorForAtomicity;
+      ULONG PhysicalBytesPerSectorForPerformance;
+      ULONG FileSystemEffectivePhysicalBytesPerSectorForAtomicity;
+      ULONG Flags;
+      ULONG ByteOffsetForSectorAlignment;
+      ULONG ByteOffsetForPartitionAlignment;
+    };
+    constexpr static auto FileStorageInfo = static_cast<FILE_INFO_BY_HANDLE_CLASS>(16);
+
+    // Pool blocks are page aligned and so are their offsets in the file, only the tail needs rounding. Sector size
+    // can only be asked for since Windows 8, before that a page is big enough for any common one.
+    _direct_alignment = 4096;
+    xFILE_STORAGE_INFO storage_info{};
+    if (GetFileInformationByHandleEx(_handle, FileStorageInfo, &storage_info, sizeof(storage_info)))
+      _direct_alignment = std::max<DWORD>(_direct_alignment, storage_info.LogicalBytesPerSector);
+  }
+
+  // Local files can be hashed right from the cache, without copying them into blocks first. Over the network the
+  // redirector's caching rules make that less of a sure thing, those are still read. Views are the cache, so
+  // only when the cache is used normally.
+  FILE_REMOTE_PROTOCOL_INFO remote_info{};
+  if (_prop_page->settings.memory_mapped
+    && cache_policy == Cache_Normal
+    && !GetFileInformationByHandleEx(_handle, FileRemoteProtocolInfo, &remote_info, sizeof(remote_info)))
+  {
+    _mapping = CreateFileMappingW(_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (_mapping)
+      return;
   }
-  
+
+  // Holes of sparse files are hashed from the zero block, there's nothing to read for them
+  if (fi.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)
+    QueryAllocatedRanges();
+
+  // Page priority only sticks to what the issuing thread reads, ring submissions may come from any file
+  _use_io_ring = !_drop_behind && GetIoRing() != nullptr;
+  if (_use_io_ring)
+    return;
+
   _threadpool_io = CreateThreadpoolIo(
     _handle,
     IoCallback,
@@ -167,153 +567,799 @@ FileHashTask::FileHashTask(Coordinator* prop_page, const std::wstring& path, con
   }
 }
 
+bool FileHashTask::LookupCache()
+{
+  if (!_prop_page->settings.hash_cache)
+    return false;
+
+  const auto cache = HashCache::Get();
+  if (!cache)
+    return false;
+
+  // Redirectors make up file indexes as they please, often 0 or the same for many files
+  FILE_REMOTE_PROTOCOL_INFO remote_info{};
+  if (GetFileInformationByHandleEx(_handle, FileRemoteProtocolInfo, &remote_info, sizeof(remote_info)))
+    return false;
+
+  // Ids that can't open the file aren't stable either, FAT makes them up from where the directory entry is
+  DWORD fs_flags{};
+  if (!GetVolumeInformationByHandleW(_handle, nullptr, 0, nullptr, nullptr, &fs_flags, nullptr, 0)
+    || !(fs_flags & FILE_SUPPORTS_OPEN_BY_FILE_ID))
+    return false;
+
+  // Both times can be set to anything through SetFileInformationByHandle, and corruption on the disk moves neither.
+  // They only catch changes made the usual way, that's why the cache is opt-in.
+  FILE_BASIC_INFO basic_info;
+  if (!GetFileInformationByHandleEx(_handle, FileBasicInfo, &basic_info, sizeof(basic_info))
+    || basic_info.ChangeTime.QuadPart == 0)
+    return false;
+
+  struct xFILE_ID_INFO {
+    ULONGLONG VolumeSerialNumber;
+    FILE_ID_128 FileId;
+  };
+  constexpr static auto FileIdInfo = static_cast<FILE_INFO_BY_HANDLE_CLASS>(18);
+
+  // The 64 bit index is just the low half of the real id on ReFS. Only there since Windows 8.
+  xFILE_ID_INFO id_info{};
+  if (GetFileInformationByHandleEx(_handle, FileIdInfo, &id_info, sizeof(id_info)))
+  {
+    memcpy(_cache_key.file_id, id_info.FileId.Identifier, sizeof(_cache_key.file_id));
+    _cache_key.volume_serial = id_info.VolumeSerialNumber;
+  }
+  else
+  {
+    _cache_key.file_id[0] = _file_index;
+    _cache_key.file_id[1] = 0;
+    _cache_key.volume_serial = _volume_serial;
+  }
+
+  if (_cache_key.file_id[0] == 0 && _cache_key.file_id[1] == 0)
+    return false;
+
+  _cache_key.size = _file_size;
+  _cache_key.last_write_time = basic_info.LastWriteTime.QuadPart;
+  _cache_key.change_time = basic_info.ChangeTime.QuadPart;
+  _cache_key_valid = true;
+
+  // Verifying against a sumfile is asking for the file to be read, a stored digest proves nothing about it
+  if (_prop_page->IsSumfile())
+    return false;
+
+  hash_results_t results;
+  for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
+    if (_prop_page->settings.algorithms[i] && !cache->Lookup(_cache_key, i, results[i]))
+      return false;
+
+  _hash_results = results;
+  return true;
+}
+
+void FileHashTask::StoreCache()
+{
+  const auto cache = HashCache::Get();
+  if (!cache)
+    return;
+
+  FILE_BASIC_INFO basic_info;
+  FILE_STANDARD_INFO standard_info;
+  if (!GetFileInformationByHandleEx(_handle, FileBasicInfo, &basic_info, sizeof(basic_info))
+    || !GetFileInformationByHandleEx(_handle, FileStandardInfo, &standard_info, sizeof(standard_info)))
+    return;
+
+  // Written to while we read it, the digests may be of neither version
+  if (static_cast<uint64_t>(standard_info.EndOfFile.QuadPart) != _cache_key.size
+    || static_cast<uint64_t>(basic_info.LastWriteTime.QuadPart) != _cache_key.last_write_time
+    || static_cast<uint64_t>(basic_info.ChangeTime.QuadPart) != _cache_key.change_time)
+    return;
+
+  for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
+    if (!_hash_results[i].empty())
+      cache->Store(_cache_key, i, _hash_results[i]);
+}
+
 FileHashTask::~FileHashTask()
 {
-  assert(_block == nullptr);
+  ReleaseContexts();
 
   if(_handle != INVALID_HANDLE_VALUE)
     CloseHandle(_handle);
-  if(_threadpool_hash_work)
-    CloseThreadpoolWork(_threadpool_hash_work);
   if(_threadpool_io)
     CloseThreadpoolIo(_threadpool_io);
+  if (_mapping)
+    CloseHandle(_mapping);
+}
+
+VOID NTAPI FileHashTask::OpenCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx
+)
+{
+  UNREFERENCED_PARAMETER(instance);
+  static_cast<FileHashTask*>(ctx)->OpenAhead();
+}
+
+void FileHashTask::OpenAhead()
+{
+  Open();
+  // StartProcessing() came while we were opening, it left starting the file to us
+  if (_open_state.exchange(OpenState_Open) & OpenState_StartRequested)
+    StartOpened();
+}
+
+void FileHashTask::Prefetch()
+{
+  auto expected = static_cast<unsigned>(OpenState_Closed);
+  if (!_open_state.compare_exchange_strong(expected, OpenState_Opening))
+    return;
+  if (!TrySubmitThreadpoolCallback(OpenCallback, this, nullptr))
+    OpenAhead();
 }
 
 void FileHashTask::StartProcessing()
 {
   _prop_page->Reference();
-  ReadBlockAsync();
+  const auto state = _open_state.fetch_or(OpenState_StartRequested);
+  if (state == OpenState_Opening)
+    return;
+  if (state == OpenState_Closed)
+  {
+    // Not prefetched, the flag we just set keeps Prefetch() away
+    Open();
+    _open_state = OpenState_Open;
+  }
+  StartOpened();
 }
 
-bool FileHashTask::ReadBlockAsync(uint8_t* reuse_block)
+void FileHashTask::StartOpened()
 {
-  if(_error != ERROR_SUCCESS)
+  if (_from_cache)
   {
-    if (reuse_block)
-      BlockFree(reuse_block);
+    _prop_page->FileProgressCallback(_file_size);
     Finish();
-    return true;
   }
+  else if (_device && _small)
+    _device->EnqueueSmall(this);
+  else if (_device)
+    _device->Enqueue(this);
+  else
+    StartReading();
+}
 
-  // Set up OVERLAPPED fields for either reading or enqueueing for read
-  _overlapped.Internal = 0; // reserved
-  _overlapped.InternalHigh = 0; // reserved
-  _overlapped.Offset = static_cast<DWORD>(_current_offset);
-  _overlapped.OffsetHigh = static_cast<DWORD>(_current_offset >> 32);
-  //_overlapped.hEvent = this; // for caller use
+void FileHashTask::SetWaitingOnDevice(bool waiting)
+{
+  _waiting_on_device = waiting;
+  _prop_page->FileWaitingOnDevice(this, waiting);
+}
 
-  if (const auto block = reuse_block ? reuse_block : BlockTryAllocate())
+void FileHashTask::StartReading()
+{
+  // Failed to open, there's nothing to read
+  if (_error != ERROR_SUCCESS)
   {
-    const auto read_size = static_cast<DWORD>(GetCurrentBlockSize());
+    Finish();
+    return;
+  }
 
-    StartThreadpoolIo(_threadpool_io);
+  uint8_t* reuse_block = nullptr;
+  AcquireSRWLockExclusive(&_read_lock);
+  Pump(reuse_block);
+}
+
+DWORD FileHashTask::StartRead(ReadSlot& slot, uint64_t offset, DWORD size)
+{
+  // Unbuffered reads go in whole sectors, the tail reads past the end of the file and just gets what's there
+  if (_direct_alignment)
+    size = (size + _direct_alignment - 1) & ~(_direct_alignment - 1);
+
+  // Submitted by Pump() once all reads it wants are in the ring
+  if (_use_io_ring)
+    return GetIoRing()->Read(_handle, slot.block, size, offset, &slot, false);
 
-    _block = block;
+  // Set up OVERLAPPED fields for either reading or enqueueing for read
+  auto& overlapped = slot.overlapped;
+  overlapped.Internal = 0; // reserved
+  overlapped.InternalHigh = 0; // reserved
+  overlapped.Offset = static_cast<DWORD>(offset);
+  overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+  //overlapped.hEvent = this; // for caller use
 
-    const auto ret = ReadFile(
+  StartThreadpoolIo(_threadpool_io);
+
+  BOOL ret;
+  DWORD error;
+  {
+    const LowPagePriority page_priority{ _drop_behind };
+    ret = ReadFile(
       _handle,
-      block,
-      read_size,
+      slot.block,
+      size,
       nullptr,
-      &_overlapped
+      &overlapped
     );
+    error = GetLastError();
+  }
 
-    const auto error = GetLastError();
+  if (ret || error == ERROR_IO_PENDING) // succeeded
+    return ERROR_SUCCESS;
 
-    if (ret || error == ERROR_IO_PENDING) // succeeded
-      return true;
+  CancelThreadpoolIo(_threadpool_io);
+  return error;
+}
 
-    _block = nullptr;
+bool FileHashTask::Pump(uint8_t*& reuse_block, bool submit)
+{
+  auto finish_now = false;
+  auto starved = false;
+  auto issued = false;
+  HashScheduler::Job jobs[HashAlgorithm::k_count];
+  auto job_count = 0u;
+  uint8_t* leftover_blocks[k_read_slots]{};
 
-    CancelThreadpoolIo(_threadpool_io);
+  if (_cancelled && _error == ERROR_SUCCESS)
+    _error = ERROR_CANCELLED;
 
-    // We failed to start the async operation, free block - cant give it back
-    BlockFree(block);
+  // Nothing to wait for with views or holes, they're ready before any consumer looks for them
+  if (_mapping)
+    MapAhead();
+  else
+    while (_error == ERROR_SUCCESS && _read_index < _block_count && _read_index - _hash_index < _read_depth)
+      if (!FillHole())
+        break;
 
-    // If we got some unknown error don't reschedule, fail instead
-    if (error != ERROR_INVALID_USER_BUFFER && error != ERROR_NOT_ENOUGH_MEMORY)
+  // Hand every idle consumer its next block, if that one is read already
+  for (auto i = 0u; i < HashAlgorithm::k_count && _error == ERROR_SUCCESS; ++i)
+  {
+    const auto index = _cursors[i];
+    if (!_is_consumer[i] || _consuming[i] || index >= _read_index)
+      continue;
+
+    const auto& slot = _read_slots[index % k_read_slots];
+    if (!slot.done)
+      continue;
+
+    if (slot.error != ERROR_SUCCESS)
     {
-      assert(_error);
-      _error = error;
-      Finish();
-      return true;
+      _error = slot.error;
+      break;
     }
+
+    // Contexts are only taken once the first block is here, so queued files don't hold any
+    if (!_contexts_acquired)
+    {
+      AcquireContexts();
+      _contexts_acquired = true;
+    }
+
+    _consuming[i] = true;
+    ++_consumers_busy;
+    jobs[job_count++] = { &HashJob, this, i };
   }
 
-  // If we just ran out of memory or outstanding async ios, requeue
-  g_read_queue.enqueue(this);
-  return false;
+  // Reads may only run ahead of the slowest consumer, that's who holds on to the oldest block
+  while (!_mapping && _error == ERROR_SUCCESS && _read_index < _block_count && _read_index - _hash_index < _read_depth)
+  {
+    // Holes past a read are handed out once that read completes and pumps again
+    if (FillHole())
+      continue;
+
+    const auto block = reuse_block ? reuse_block : BlockTryAllocate();
+    if (!block)
+    {
+      // Only wait in the queue if nothing else will wake us up
+      starved = _read_index == _hash_index;
+      break;
+    }
+    reuse_block = nullptr;
+
+    auto& slot = _read_slots[_read_index % k_read_slots];
+    slot.block = block;
+    slot.error = ERROR_SUCCESS;
+    slot.done = false;
+
+    const auto offset = _read_index * k_block_size;
+    const auto error = StartRead(slot, offset, static_cast<DWORD>(GetBlockSize(_read_index)));
+
+    if (error == ERROR_SUCCESS)
+    {
+      ++_read_index;
+      ++_reads_in_flight;
+      issued = true;
+      continue;
+    }
+
+    slot.block = nullptr;
+    BlockFree(block);
+
+    // If we just ran out of memory or outstanding async ios, retry later. Otherwise fail instead.
+    if (error == ERROR_INVALID_USER_BUFFER || error == ERROR_NOT_ENOUGH_MEMORY)
+      starved = _read_index == _hash_index;
+    else
+      _error = error;
+    break;
+  }
+
+  // Whatever went wrong, reads still in flight have to land before we can go away
+  if (_consumers_busy == 0 && _reads_in_flight == 0 && (_error != ERROR_SUCCESS || _hash_index == _block_count))
+  {
+    finish_now = true;
+    auto count = 0u;
+    for (auto& slot : _read_slots)
+      if (slot.block)
+        leftover_blocks[count++] = std::exchange(slot.block, nullptr);
+  }
+
+  const auto use_io_ring = _use_io_ring;
+  const auto mapped = _mapping != nullptr;
+  const auto scheduler = job_count ? GetScheduler(_prop_page->settings.hash_threads) : nullptr;
+
+  // Once this is released anything in flight may finish the file, only the decisions made above are ours to act on
+  ReleaseSRWLockExclusive(&_read_lock);
+
+  if (issued && submit && use_io_ring)
+    GetIoRing()->Submit();
+
+  if (finish_now)
+  {
+    for (const auto block : leftover_blocks)
+      if (block)
+        ReleaseBlock(block, mapped);
+    Finish();
+  }
+
+  if (starved)
+    g_read_queue.enqueue(this);
+
+  if (job_count)
+    scheduler->Submit(jobs, job_count);
+
+  return !starved;
 }
 
-void FileHashTask::OverlappedCompletionRoutine(ULONG error_code, ULONG_PTR bytes_transferred)
+void FileHashTask::ReadCompleted(ReadSlot* slot, ULONG error_code, size_t bytes_transferred)
 {
-  UNREFERENCED_PARAMETER(bytes_transferred);
+  if (error_code == ERROR_SUCCESS)
+    _device->AddBytesRead(bytes_transferred);
 
   uint8_t* reuse_block = nullptr;
+  AcquireSRWLockExclusive(&_read_lock);
+  slot->error = error_code;
+  slot->done = true;
+  --_reads_in_flight;
+  Pump(reuse_block);
+  ProcessReadQueue();
+}
 
-  if (_cancelled)
-    error_code = ERROR_CANCELLED;
+FileHashTask::ProbeResult FileHashTask::ProbeCached() const
+{
+  if (_error != ERROR_SUCCESS || _cancelled || _file_size == 0)
+    return Probe_Skipped;
+
+  const auto handle = utl::OpenForRead(_path, true);
+  if (handle == INVALID_HANDLE_VALUE)
+    return Probe_Skipped;
 
-  if (error_code != ERROR_SUCCESS)
+  // The device queue knows the kind of every volume it has seen, probing a new one only happens once
+  BY_HANDLE_FILE_INFORMATION fi;
+  if (!GetFileInformationByHandle(handle, &fi)
+    || DeviceQueue::ForVolume(fi.dwVolumeSerialNumber, _path)->GetKind() == DeviceQueue::Kind::Rotational)
   {
-    _error = error_code;
-    reuse_block = _block;
-    _block = nullptr;
-    BlockReset(reuse_block);
-    Finish();
+    CloseHandle(handle);
+    return Probe_Skipped;
   }
-  else
+
+  // A read the cache can satisfy completes right away even on an overlapped handle, anything that has to go to the
+  // disk is left pending. A page from each end is enough to tell a file that was just copied or read.
+  uint8_t page[4096];
+  const uint64_t last_page = (_file_size - 1) & ~static_cast<uint64_t>(sizeof(page) - 1);
+  const uint64_t offsets[] = { 0, last_page };
+  const auto probe_count = last_page ? 2u : 1u;
+
+  auto cached = true;
+  for (auto i = 0u; i < probe_count && cached; ++i)
   {
-    AddToHashQueue();
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offsets[i]);
+    overlapped.OffsetHigh = static_cast<DWORD>(offsets[i] >> 32);
+    if (ReadFile(handle, page, sizeof(page), nullptr, &overlapped))
+      continue;
+
+    cached = false;
+    // The page is still being read into, wait it out
+    if (GetLastError() == ERROR_IO_PENDING)
+    {
+      CancelIoEx(handle, &overlapped);
+      DWORD bytes_read;
+      GetOverlappedResult(handle, &overlapped, &bytes_read, TRUE);
+    }
   }
 
-  ProcessReadQueue(reuse_block);
+  CloseHandle(handle);
+  return cached ? Probe_Cached : Probe_Uncached;
 }
 
-void FileHashTask::AddToHashQueue()
+DWORD FileHashTask::StartSmallRead(uint8_t* buffer, OVERLAPPED& overlapped)
 {
-  assert(_block);
+  const auto size = static_cast<DWORD>(_file_size);
+  if (size == 0)
+    return ERROR_SUCCESS;
 
-  _hash_start_counter.store(HashAlgorithm::k_count, std::memory_order_relaxed);
-  _hash_finish_counter.store(HashAlgorithm::k_count, std::memory_order_relaxed);
+  // Small files aren't bound to a completion port and have only this one read in flight, so the handle itself is
+  // signaled once it's done. No event needed.
+  overlapped = {};
 
-  for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
-    SubmitThreadpoolWork(_threadpool_hash_work);
+  const LowPagePriority page_priority{ _drop_behind };
+
+  if (!ReadFile(_handle, buffer, size, nullptr, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+    return GetLastError();
+  return ERROR_SUCCESS;
 }
 
-void FileHashTask::DoHashRound()
+DWORD FileHashTask::FinishSmallRead(OVERLAPPED& overlapped)
 {
-  const auto ctx_index = --_hash_start_counter;
-  const auto ctx = _hash_contexts[ctx_index].get();
-  const auto block_size = GetCurrentBlockSize();
-  if (ctx)
-    ctx->Update(_block, block_size);
-  const auto locks_on_this = --_hash_finish_counter;
-  if (locks_on_this == 0)
-    FinishedBlock();
+  const auto size = static_cast<DWORD>(_file_size);
+  if (size == 0)
+    return ERROR_SUCCESS;
+
+  DWORD bytes_read{};
+  if (!GetOverlappedResult(_handle, &overlapped, &bytes_read, TRUE))
+    return GetLastError();
+
+  // Shrunk since we opened it
+  if (bytes_read != size)
+    return ERROR_HANDLE_EOF;
+
+  _device->AddBytesRead(bytes_read);
+  return ERROR_SUCCESS;
 }
 
-void FileHashTask::FinishedBlock()
+void FileHashTask::MapAhead()
 {
-  const auto block_size = GetCurrentBlockSize();
-  _prop_page->FileProgressCallback(block_size);
-  _current_offset += block_size;
-  auto reuse_block = _block;
-  _block = nullptr;
-  BlockReset(reuse_block);
+  // Views are mapped as far ahead as reads would be, that's how much of a huge file is mapped at once
+  while (_error == ERROR_SUCCESS && _read_index < _block_count && _read_index - _hash_index < _read_depth)
+  {
+    const auto offset = _read_index * k_block_size;
+    const auto size = GetBlockSize(_read_index);
+    const auto view = MapViewOfFile(
+      _mapping,
+      FILE_MAP_READ,
+      static_cast<DWORD>(offset >> 32),
+      static_cast<DWORD>(offset),
+      size
+    );
+    if (!view)
+    {
+      _error = GetLastError();
+      break;
+    }
+
+    // Gets the disk busy while the consumers are still on the blocks before, like a read would
+    PrefetchView(view, size);
 
-  if (GetCurrentBlockSize() > 0 && !_cancelled)
+    auto& slot = _read_slots[_read_index % k_read_slots];
+    slot.block = static_cast<uint8_t*>(view);
+    slot.error = ERROR_SUCCESS;
+    slot.done = true;
+    ++_read_index;
+  }
+}
+
+bool FileHashTask::FillHole()
+{
+  if (!IsHole(_read_index))
+    return false;
+
+  auto& slot = _read_slots[_read_index % k_read_slots];
+  slot.block = const_cast<uint8_t*>(GetZeroBlock());
+  slot.error = ERROR_SUCCESS;
+  slot.done = true;
+  ++_read_index;
+  return true;
+}
+
+bool FileHashTask::IsHole(uint64_t index)
+{
+  if (!_sparse)
+    return false;
+
+  const auto begin = index * k_block_size;
+  const auto end = begin + GetBlockSize(index);
+  while (_range_cursor < _allocated_ranges.size())
   {
-    ReadBlockAsync(reuse_block);
-    reuse_block = nullptr;
+    const auto& range = _allocated_ranges[_range_cursor];
+    if (range.offset + range.length > begin)
+      break;
+    ++_range_cursor;
   }
+  return _range_cursor == _allocated_ranges.size() || _allocated_ranges[_range_cursor].offset >= end;
+}
+
+void FileHashTask::QueryAllocatedRanges()
+{
+  if (!GetZeroBlock())
+    return;
+
+  // The handle is overlapped, so even this needs an OVERLAPPED to wait on
+  OVERLAPPED overlapped{};
+  overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+  if (!overlapped.hEvent)
+    return;
+
+  FILE_ALLOCATED_RANGE_BUFFER output[64];
+  FILE_ALLOCATED_RANGE_BUFFER input{};
+  input.Length.QuadPart = static_cast<LONGLONG>(_file_size);
+
+  DWORD error;
+  do
+  {
+    DWORD returned{};
+    auto success = DeviceIoControl(
+      _handle,
+      FSCTL_QUERY_ALLOCATED_RANGES,
+      &input,
+      sizeof(input),
+      output,
+      sizeof(output),
+      &returned,
+      &overlapped
+    );
+    if (!success && GetLastError() == ERROR_IO_PENDING)
+      success = GetOverlappedResult(_handle, &overlapped, &returned, TRUE);
+    error = success ? ERROR_SUCCESS : GetLastError();
+    if (error != ERROR_SUCCESS && error != ERROR_MORE_DATA)
+      break;
+
+    const auto count = returned / sizeof(*output);
+    for (auto i = 0u; i < count; ++i)
+      _allocated_ranges.push_back({
+        static_cast<uint64_t>(output[i].FileOffset.QuadPart),
+        static_cast<uint64_t>(output[i].Length.QuadPart)
+      });
+
+    // Didn't fit, ask again for what's after the last one we got
+    if (error == ERROR_MORE_DATA)
+    {
+      if (count == 0)
+        break;
+      const auto& last = output[count - 1];
+      const auto next = last.FileOffset.QuadPart + last.Length.QuadPart;
+      input.FileOffset.QuadPart = next;
+      input.Length.QuadPart = static_cast<LONGLONG>(_file_size) - next;
+    }
+  }
+  while (error == ERROR_MORE_DATA);
+
+  CloseHandle(overlapped.hEvent);
+
+  // Whatever we don't know about is read like any other file
+  _sparse = error == ERROR_SUCCESS;
+  if (!_sparse)
+    _allocated_ranges = {};
+}
+
+void FileHashTask::ReleaseBlock(uint8_t* block, bool mapped)
+{
+  // Not ours, shared by everyone
+  if (block == GetZeroBlock())
+    return;
+  if (mapped)
+    UnmapViewOfFile(block);
   else
+    BlockFree(block);
+}
+
+void FileHashTask::AcquireContexts()
+{
+  for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
+    if (_prop_page->settings.algorithms[i])
+      _hash_contexts[i] = HashAlgorithm::g_hashers[i].AcquireContext();
+
+  // Fused rounds and views never go to an engine, no point making it look busier than it is. A file is one stream
+  // of an engine even if several of its algorithms share it (SHA-224 and SHA-256), they can't fill separate lanes
+  // with it at the same time. The first of them holds the stream, their digests are final at about the same time.
+  if (!_fused && !_mapping)
+    for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
+      if (const auto ctx = _hash_contexts[i])
+        if (const auto engine = MultiBufferHasher::ForAlgorithm(ctx->GetAlgorithm()))
+          if (std::find(std::begin(_multi_buffer_engines), std::end(_multi_buffer_engines), engine)
+            == std::end(_multi_buffer_engines))
+          {
+            engine->AddStream();
+            _multi_buffer_engines[i] = engine;
+          }
+
+  // Subtrees hashed on other threads are out of reach for the in-page error handling, views are hashed by one
+  if (_file_size >= k_parallel_min_file_size && !_mapping)
+    for (const auto ctx : _hash_contexts)
+      if (ctx)
+        ctx->SetParallelJoin(&ParallelJoin);
+}
+
+void FileHashTask::ReleaseContexts()
+{
+  for (auto& ctx : _hash_contexts)
   {
-    if (_cancelled)
-      _error = ERROR_CANCELLED;
-    Finish();
+    if (ctx)
+      HashAlgorithm::ReleaseContext(ctx);
+    ctx = nullptr;
+  }
+  for (auto& engine : _multi_buffer_engines)
+    if (const auto released = std::exchange(engine, nullptr))
+      released->RemoveStream();
+}
+
+void FileHashTask::DoHashRound(size_t ctx_index)
+{
+  if (_fused)
+  {
+    DoFusedHashRound();
+    return;
+  }
+
+  const auto ctx = _hash_contexts[ctx_index];
+  const auto index = _cursors[ctx_index];
+  DWORD error = ERROR_SUCCESS;
+  // Holes don't even need looking at if the algorithm can skip ahead over zeros
+  if (ctx && !(GetBlock(index) == GetZeroBlock() && ctx->UpdateZeros(GetBlockSize(index))))
+  {
+    // The engine finishes the round for us once our lane is done. It hashes on its own thread, so not for views.
+    if (!_mapping && SubmitMultiBuffer(ctx_index))
+      return;
+    if (_mapping)
+      error = GuardedUpdate(ctx, GetBlock(index), GetBlockSize(index));
+    else
+      ctx->Update(GetBlock(index), GetBlockSize(index));
+  }
+  FinishedBlock(ctx_index, error);
+}
+
+void FileHashTask::DoFusedHashRound()
+{
+  const auto index = _cursors[0];
+  const auto block = GetBlock(index);
+  const auto block_size = GetBlockSize(index);
+
+  // Contexts that skip over holes are done with them right here
+  const auto zeros = block == GetZeroBlock();
+  HashContext* contexts[HashAlgorithm::k_count]{};
+  auto context_count = 0u;
+  for (const auto ctx : _hash_contexts)
+    if (ctx && !(zeros && ctx->UpdateZeros(block_size)))
+      contexts[context_count++] = ctx;
+
+  DWORD error = ERROR_SUCCESS;
+  for (size_t offset = 0; offset < block_size && error == ERROR_SUCCESS; offset += k_fused_tile_size)
+  {
+    const auto tile_size = std::min(block_size - offset, k_fused_tile_size);
+    for (auto i = 0u; i < context_count; ++i)
+    {
+      const auto ctx = contexts[i];
+      if (_mapping)
+        error = GuardedUpdate(ctx, block + offset, tile_size);
+      else
+        ctx->Update(block + offset, tile_size);
+      if (error != ERROR_SUCCESS)
+        break;
+    }
+  }
+  FinishedBlock(0, error);
+}
+
+bool FileHashTask::SubmitMultiBuffer(size_t ctx_index)
+{
+  const auto ctx = _hash_contexts[ctx_index];
+  const auto engine = MultiBufferHasher::ForAlgorithm(ctx->GetAlgorithm());
+  const auto state = ctx->GetRawState();
+  if (!engine || !state || !engine->IsWorthIt())
+    return false;
+
+  const auto index = _cursors[ctx_index];
+  const auto block = GetBlock(index);
+  const auto block_size = GetBlockSize(index);
+  const auto buffered = ctx->GetBufferedSize();
+  const auto head = buffered ? std::min<size_t>(64 - buffered, block_size) : 0;
+  const auto blocks = (block_size - head) / 64;
+  if (blocks < k_multi_buffer_min_blocks)
+    return false;
+
+  // Get the context block aligned, the engine only works on whole blocks
+  if (head)
+    ctx->Update(block, head);
+
+  auto& round = _multi_buffer_rounds[ctx_index];
+  round.blocks = blocks;
+  round.tail_offset = head + blocks * 64;
+
+  const MultiBufferHasher::Job job{
+    state,
+    block + head,
+    blocks,
+    &MultiBufferCompletion,
+    reinterpret_cast<void*>(ToLparam(ctx_index))
+  };
+
+  if (engine->Submit(job))
+    if (!TrySubmitThreadpoolCallback(MultiBufferDrainCallback, engine, nullptr))
+      engine->Drain();
+
+  return true;
+}
+
+void FileHashTask::FinishMultiBuffer(size_t ctx_index)
+{
+  const auto ctx = _hash_contexts[ctx_index];
+  const auto& round = _multi_buffer_rounds[ctx_index];
+  const auto index = _cursors[ctx_index];
+  const auto block_size = GetBlockSize(index);
+  ctx->AddRawBlocks(round.blocks);
+  if (round.tail_offset < block_size)
+    ctx->Update(GetBlock(index) + round.tail_offset, block_size - round.tail_offset);
+  FinishedBlock(ctx_index);
+}
+
+void FileHashTask::PublishDigests(size_t consumer)
+{
+  for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
+  {
+    // A fused consumer does every context, otherwise just its own
+    if (!_fused && i != consumer)
+      continue;
+    if (const auto ctx = std::exchange(_hash_contexts[i], nullptr))
+    {
+      _hash_results[i] = ctx->Finish();
+      HashAlgorithm::ReleaseContext(ctx);
+    }
+    if (const auto engine = std::exchange(_multi_buffer_engines[i], nullptr))
+      engine->RemoveStream();
   }
+}
 
+void FileHashTask::FinishedBlock(size_t consumer, DWORD error)
+{
+  // That was our last block, the digest is final. No need to keep the context until the slowest one is done too.
+  if (_cursors[consumer] + 1 == _block_count)
+    PublishDigests(consumer);
+
+  uint8_t* freed_blocks[k_read_slots]{};
+  auto freed_count = 0u;
+  uint64_t freed_bytes = 0;
+
+  AcquireSRWLockExclusive(&_read_lock);
+  if (error != ERROR_SUCCESS && _error == ERROR_SUCCESS)
+    _error = error;
+  ++_cursors[consumer];
+  _consuming[consumer] = false;
+  --_consumers_busy;
+
+  auto slowest = _block_count;
+  for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
+    if (_is_consumer[i])
+      slowest = std::min(slowest, _cursors[i]);
+
+  // Blocks every consumer is past can be read into again. The zero block isn't ours to give back.
+  for (; _hash_index < slowest; ++_hash_index)
+  {
+    freed_bytes += GetBlockSize(_hash_index);
+    const auto block = std::exchange(_read_slots[_hash_index % k_read_slots].block, nullptr);
+    if (block != GetZeroBlock())
+      freed_blocks[freed_count++] = block;
+  }
+
+  if (freed_bytes)
+    _prop_page->FileProgressCallback(freed_bytes);
+
+  // Views had no completed read to count them, the device only sees them as they're hashed
+  const auto mapped = _mapping != nullptr;
+  if (mapped && freed_bytes)
+    _device->AddBytesRead(freed_bytes);
+
+  // The first one goes straight into our own read-ahead, if there's more to read. Views aren't reused, the next
+  // block is a view of its own.
+  auto reuse_block = mapped ? nullptr : freed_blocks[0];
+  Pump(reuse_block);
+
+  for (auto i = mapped ? 0u : 1u; i < freed_count; ++i)
+    ReleaseBlock(freed_blocks[i], mapped);
   ProcessReadQueue(reuse_block);
 }
 
@@ -326,10 +1372,10 @@ void FileHashTask::Finish()
 
     for (auto i = 0u; i < HashAlgorithm::k_count; ++i)
     {
-      auto& it_result = _hash_results[i];
-      const auto it_ctx = _hash_contexts[i].get();
-      if(it_ctx)
-        it_result = it_ctx->Finish();
+      // Published by the consumer as soon as it was done, empty if the algorithm is disabled
+      const auto& it_result = _hash_results[i];
+      if (it_result.empty())
+        continue;
 
       // TODO: O(n^2) BABY HERE WE GO
       for(const auto& expected : _file_info.expected_hashes)
@@ -341,6 +1387,29 @@ void FileHashTask::Finish()
       }
     }
   }
+  else
+  {
+    // Consumers publish as soon as they are done, a failed file must not keep what some of them got to publish
+    _hash_results.fill({});
+  }
+
+  ReleaseContexts();
+
+  // Needs the handle to check the file didn't change in the meantime
+  if (!_error && !_from_cache && _cache_key_valid)
+    StoreCache();
+
+  // Only the results are kept from here on, with a lot of files we can't hold on to every handle
+  if (_threadpool_io)
+    CloseThreadpoolIo(std::exchange(_threadpool_io, nullptr));
+  if (_mapping)
+    CloseHandle(std::exchange(_mapping, nullptr)); // views still out keep the section alive
+  if (_handle != INVALID_HANDLE_VALUE)
+    CloseHandle(std::exchange(_handle, INVALID_HANDLE_VALUE));
+
+  // Let the next file on this device start, small files give back their drainer's slot once it's out of them
+  if (_device && !_small)
+    _device->Release();
 
   _prop_page->FileCompletionCallback(this);
   _prop_page->Dereference();
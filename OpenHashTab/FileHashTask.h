@@ -15,13 +15,20 @@
 //    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
 #pragma once
 
+#include "HashCache.h"
 #include "path.h"
 
 #include <atomic>
 #include <memory>
 #include <array>
+#include <vector>
 
+class BlockPool;
 class Coordinator;
+class DeviceQueue;
+class HashScheduler;
+class IoRingReader;
+class MultiBufferHasher;
 
 class FileHashTask
 {
@@ -29,21 +36,29 @@ class FileHashTask
   // but also increase memory usage
   constexpr static size_t k_block_size = 2 << 20; // 2 MB
 
-  // Increasing this will increase memory use and reduce
-  // possibility of a slower disk clogging up the queue
-  constexpr static intptr_t k_max_allocations = 512; // 1 GB
+public:
+  // What reading files does to the system file cache, see Settings::cache_policy
+  enum CachePolicy : DWORD
+  {
+    Cache_Normal,
+    Cache_Direct,     // unbuffered, read right into the blocks and never cached
+    Cache_DropBehind  // cached, but what we read is the first to be repurposed
+  };
 
-  static std::atomic<intptr_t> s_allocations_remaining;
+  // Created on first use, budget and page size come from the settings
+  static BlockPool* GetBlockPool();
 
+private:
   static uint8_t* BlockTryAllocate();
-  static void BlockReset(uint8_t* p);
   static void BlockFree(uint8_t* p);
 
-  static VOID NTAPI HashWorkCallback(
-    _Inout_     PTP_CALLBACK_INSTANCE instance,
-    _Inout_opt_ PVOID                 ctx,
-    _Inout_     PTP_WORK              work
-  );
+  // A read-only block of zeros standing in for holes of sparse files, shared by all. Null if it couldn't be made.
+  static const uint8_t* GetZeroBlock();
+
+  // Created on first use with thread_count, later calls get the same one
+  static HashScheduler* GetScheduler(unsigned thread_count);
+
+  static void HashJob(void* ctx, size_t ctx_index);
 
   static VOID WINAPI IoCallback(
     _Inout_     PTP_CALLBACK_INSTANCE instance,
@@ -54,41 +69,165 @@ class FileHashTask
     _Inout_     PTP_IO                io
   );
 
+  static VOID NTAPI MultiBufferDrainCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx
+  );
+
+  static void MultiBufferCompletion(void* param);
+
+  static VOID NTAPI ParallelJoinCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx
+  );
+
+  static void ParallelJoin(void (*task)(void*), void* left, void* right);
+
   static void ProcessReadQueue(uint8_t* reuse_block = nullptr);
 
-  uint8_t* _block{nullptr};
+  // Shared by every task, null when the OS has no I/O rings (before Windows 11)
+  static IoRingReader* GetIoRing();
+
+  static void IoRingCompletion(void* user_data, DWORD error, size_t bytes_transferred);
+
+  // Files up to this size skip the read-ahead, threadpool I/O and block pool entirely. They wait in their device's
+  // small file queue, are read into one shared buffer a batch at a time with all reads of the batch in flight
+  // together, and the same thread hashes the whole batch.
+  constexpr static uint64_t k_small_file_size = 64 << 10; // 64 KB
+  constexpr static size_t k_small_batch_files = 16;
+  constexpr static size_t k_small_batch_size = k_small_batch_files * k_small_file_size;
+
+  // Rounds shorter than this aren't worth handing to the multi-buffer engine
+  constexpr static size_t k_multi_buffer_min_blocks = 16;
+
+  // Files at least this big let tree hashes split each block across threadpool workers
+  constexpr static uint64_t k_parallel_min_file_size = 64 << 20; // 64 MB
+
+  // In fused mode a single worker runs every context over the block, one tile at a time, so a tile is only
+  // ever read from memory once. Should fit comfortably in L1 / L2 along with the hash states.
+  constexpr static size_t k_fused_tile_size = 32 << 10; // 32 KB
 
-  PTP_WORK _threadpool_hash_work = nullptr;
+  // Most blocks a file can have between reading and hashing, including the one being hashed
+  constexpr static size_t k_read_slots = 8;
+
+  struct ReadSlot
+  {
+    OVERLAPPED overlapped;
+    FileHashTask* task;
+    uint8_t* block;
+    DWORD error;
+    bool done;
+  };
+
+  // Block k of the file goes in slot k % k_read_slots. Each consumer (an algorithm, or all of them in fused mode)
+  // has its own cursor and takes blocks strictly in order, but fast ones don't wait for the slow ones. A slot is read
+  // into again once every cursor is past it, reads run ahead of the slowest cursor by up to _read_depth blocks.
+  ReadSlot _read_slots[k_read_slots]{};
+
+  // Guards the read slots, cursors and indices below
+  SRWLOCK _read_lock = SRWLOCK_INIT;
+
+  uint64_t _block_count{};
+  uint64_t _read_index{};
+  uint64_t _hash_index{}; // slowest cursor, the oldest block still in use
+  uint64_t _cursors[HashAlgorithm::k_count]{}; // next block of each consumer, the one it hashes while consuming
+  bool _is_consumer[HashAlgorithm::k_count]{};
+  bool _consuming[HashAlgorithm::k_count]{};
+  unsigned _consumers_busy{};
+  unsigned _reads_in_flight{};
+  unsigned _read_depth{ 1 };
+  bool _contexts_acquired{};
 
   PTP_IO _threadpool_io = nullptr;
+
+  // Data of a sparse file, sorted by offset. Blocks falling in between are holes and aren't read at all.
+  struct AllocatedRange
+  {
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  std::vector<AllocatedRange> _allocated_ranges;
+  size_t _range_cursor{}; // first range that doesn't end before the block last asked about
+  bool _sparse{}; // set once the ranges are known
+
+  // Set if the file is hashed straight from mapped views. The blocks in the read slots are then views of the file
+  // instead of pool blocks, and a read is just mapping the next one.
+  HANDLE _mapping{};
   
-  std::unique_ptr<HashContext> _hash_contexts[HashAlgorithm::k_count];
+  // Taken from the per-algorithm pools when hashing starts, given back after Finish()
+  HashContext* _hash_contexts[HashAlgorithm::k_count];
 
-  OVERLAPPED _overlapped{};
+  struct MultiBufferRound
+  {
+    size_t blocks;
+    size_t tail_offset;
+  };
 
-  using hash_results_t = std::array<std::vector<uint8_t>, HashAlgorithm::k_count>;
+  MultiBufferRound _multi_buffer_rounds[HashAlgorithm::k_count]{};
+
+  // Engines we count as a stream of, for as long as the context is ours. Each engine only once, see AcquireContexts()
+  MultiBufferHasher* _multi_buffer_engines[HashAlgorithm::k_count]{};
+
+  using hash_results_t = std::array<HashDigest, HashAlgorithm::k_count>;
 
   hash_results_t _hash_results;
 
-  HANDLE _handle;
+  HANDLE _handle = INVALID_HANDLE_VALUE;
+
+  enum : unsigned
+  {
+    OpenState_Closed,
+    OpenState_Opening,
+    OpenState_Open,
+    OpenState_StartRequested = 4 // flag
+  };
+
+  std::atomic<unsigned> _open_state{};
 
   Coordinator* _prop_page;
 
+  // Null if the file failed to open
+  DeviceQueue* _device{};
+
+  uint64_t _layout_key{};
+
   ProcessedFileList::FileInfo _file_info;
 
+  std::wstring _path;
+
   uint64_t _file_size{};
-  uint64_t _current_offset{};
 
-  uint64_t _file_index;
-  uint32_t _volume_serial;
+  uint64_t _file_index{};
+  uint32_t _volume_serial{};
 
-  DWORD _error{ ERROR_SUCCESS };
+  // What the digests are stored under once hashed, only valid if _cache_key_valid
+  HashCache::Key _cache_key{};
+  bool _cache_key_valid{};
 
-  std::atomic<unsigned> _hash_start_counter{ 0 };
-  std::atomic<unsigned> _hash_finish_counter{ 0 };
+  // Every enabled algorithm was found in the hash cache, the file isn't read at all
+  bool _from_cache{};
+
+  DWORD _error{ ERROR_SUCCESS };
 
   int _match_state{};
   bool _cancelled{};
+  bool _fused{};
+  bool _use_io_ring{};
+  bool _small{};
+  bool _drop_behind{};
+
+  // Set by the coordinator when the file turned out to be in the file cache before it was let in
+  bool _resident{};
+
+  // Which of the coordinator's slots the file was let in with. The size it went by may change once it's opened.
+  bool _admitted_priority{};
+
+  // Given its slot in the window back while it waits on the device, guarded by the device queue's lock
+  bool _waiting_on_device{};
+
+  // Nonzero for unbuffered reads, their sizes are rounded up to this
+  DWORD _direct_alignment{};
 
   uint8_t _lparam_idx[HashAlgorithm::k_count]{};
 
@@ -104,33 +243,118 @@ public:
   // TODO: check this somehow
   ~FileHashTask();
 
+  // Opens the file on the threadpool, so StartProcessing() doesn't have to wait for it. Files not prefetched are
+  // opened by StartProcessing() itself.
+  void Prefetch();
+
   void StartProcessing();
 
+  // Called by the device queue once it's our turn
+  void StartReading();
+
+  // Started by the device queue for its small files. Drainers block on reads, so they run on the threadpool instead
+  // of the hash workers. Each holds one of the device's slots until the queue is empty.
+  static VOID NTAPI SmallFileDrainCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx
+  );
+
+  static void DrainSmallFiles(DeviceQueue* device);
+
 private:
-  // Enqueue the next block for reading
-  // Returns true if an async io was started, false if the file was enqueued
-  bool ReadBlockAsync(uint8_t* reuse_block = nullptr);
+  static VOID NTAPI OpenCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx
+  );
+
+  // Opens the file and sets up everything reading it needs. Failures end up in _error.
+  void Open();
+
+  void OpenAhead();
+
+  // Fills _hash_results from the hash cache if all enabled algorithms are in it. Also sets up _cache_key for
+  // StoreCache() if the file has to be hashed after all. Files without an id to trust, like remote ones or those on
+  // FAT, don't get a key and are never cached.
+  bool LookupCache();
+
+  // Stores the results, unless the file changed while it was being read
+  void StoreCache();
+
+  // Called once the file is open, by whoever got there last of StartProcessing() and the prefetch
+  void StartOpened();
+
+  // Does whatever the file can do right now: hand idle consumers their next block if it's read, fill the
+  // read-ahead up to _read_depth, or finish. reuse_block is taken for the first read, if there's one.
+  // Returns false if the file couldn't get a block for its next read and was put in the read queue.
+  // With submit false reads may sit in the ring until the next IoRingReader::Submit()
+  // Call with _read_lock held, it's released before returning. Updating the state and deciding what to do about it
+  // under the same lock is what makes sure only one thread ever sees the file done.
+  // Do NOT use "this" after calling Pump(), the file might have finished.
+  bool Pump(uint8_t*& reuse_block, bool submit = true);
+
+  // Returns the error if the read could not be started
+  DWORD StartRead(ReadSlot& slot, uint64_t offset, DWORD size);
 
-  void OverlappedCompletionRoutine(ULONG error_code, ULONG_PTR bytes_transferred);
+  void ReadCompleted(ReadSlot* slot, ULONG error_code, size_t bytes_transferred);
 
-  void AddToHashQueue();
+  // Mapped counterpart of the reads in Pump(), call with _read_lock held
+  void MapAhead();
 
-  void DoHashRound();
+  // Reads where the data of a sparse file is. Leaves _allocated_ranges empty if it couldn't tell.
+  void QueryAllocatedRanges();
 
-  void FinishedBlock();
+  // Whether the block has no data at all. Ask in increasing order of index, with _read_lock held.
+  bool IsHole(uint64_t index);
+
+  // If the next block to read is a hole, puts the zero block in its slot in place of reading it and returns true.
+  // Call with _read_lock held.
+  bool FillHole();
+
+  // Gives back a block, or unmaps it if it's a view
+  static void ReleaseBlock(uint8_t* block, bool mapped);
+
+  // Small file path: starts reading the whole file into buffer, so a batch can have all its reads in flight at once.
+  // Returns the error, if any. A read that was started has to be waited for with FinishSmallRead().
+  DWORD StartSmallRead(uint8_t* buffer, OVERLAPPED& overlapped);
+
+  DWORD FinishSmallRead(OVERLAPPED& overlapped);
+
+  void AcquireContexts();
+
+  void ReleaseContexts();
+
+  void DoHashRound(size_t ctx_index);
+
+  // Fused mode counterpart of DoHashRound(), does all contexts for the current block.
+  void DoFusedHashRound();
+
+  // Hand the whole blocks of this round to the context's multi-buffer engine, if it has one and enough streams to
+  // fill most of its lanes. Returns false if the round should be hashed here instead.
+  bool SubmitMultiBuffer(size_t ctx_index);
+
+  void FinishMultiBuffer(size_t ctx_index);
+
+  // Finish the consumer's digests and give back its contexts, called once it's through the file
+  void PublishDigests(size_t consumer);
+
+  // Moves the consumer's cursor, recycling blocks no one needs anymore. error fails the file, if the block couldn't
+  // be hashed.
+  void FinishedBlock(size_t consumer, DWORD error = ERROR_SUCCESS);
 
   // Do NOT use "this" after calling Finish(), as it might be deleted
   // This may be the last reference to Coordinator, which then deletes us in destructor.
   void Finish();
 
-  size_t GetCurrentBlockSize() const
+  size_t GetBlockSize(uint64_t index) const
   {
-    auto size = _file_size - _current_offset;
+    auto size = _file_size - index * k_block_size;
     if (size > k_block_size)
       size = k_block_size;
     return (size_t)size;
   }
 
+  const uint8_t* GetBlock(uint64_t index) const { return _read_slots[index % k_read_slots].block; }
+
 public:
   LPARAM ToLparam(size_t hasher) const { return reinterpret_cast<LPARAM>(&_lparam_idx[hasher]); }
   static std::pair<FileHashTask*, size_t> FromLparam(LPARAM lparam)
@@ -141,9 +365,11 @@ public:
 
   DWORD GetError() const { return _error; }
   uint64_t GetSize() const { return _file_size; }
+  uint64_t GetLayoutKey() const { return _layout_key; }
   HANDLE GetHandle() const { return _handle; }
   const hash_results_t& GetHashResult() const { return _hash_results; }
   const std::wstring& GetDisplayName() const { return _file_info.relative_path; }
+  const std::wstring& GetPath() const { return _path; }
 
   enum : int
   {
@@ -153,4 +379,28 @@ public:
   int GetMatchState() const { return _match_state; }
 
   void SetCancelled() { _cancelled = true; }
+
+  enum ProbeResult
+  {
+    Probe_Cached,
+    Probe_Uncached, // cost a read from the device, cancelling doesn't stop one that's already on its way
+    Probe_Skipped   // couldn't tell, or not worth finding out
+  };
+
+  // Whether both ends of the file are in the file cache. Opens a handle of its own, so it works on files not opened
+  // yet. A miss costs a small read. Files on rotational disks are skipped, each miss would be two seeks.
+  ProbeResult ProbeCached() const;
+
+  bool IsResident() const { return _resident; }
+
+  // The digests came from the hash cache, the file wasn't read
+  bool IsFromCache() const { return _from_cache; }
+  void SetResident() { _resident = true; }
+
+  // Called by the device queue with its lock held, tells the coordinator whether the file counts against the window
+  void SetWaitingOnDevice(bool waiting);
+  bool IsWaitingOnDevice() const { return _waiting_on_device; }
+
+  bool IsAdmittedPriority() const { return _admitted_priority; }
+  void SetAdmittedPriority(bool priority) { _admitted_priority = priority; }
 };
\ No newline at end of file
@@ -0,0 +1,243 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#include "stdafx.h"
+
+#include "HashCache.h"
+
+#include <winioctl.h>
+
+#include <cstring>
+#include <string>
+
+HashCache* HashCache::Get()
+{
+  static const auto cache = []() -> HashCache*
+  {
+    wchar_t local_app_data[MAX_PATH];
+    const auto length = GetEnvironmentVariableW(L"LOCALAPPDATA", local_app_data, static_cast<DWORD>(std::size(local_app_data)));
+    if (length == 0 || length >= std::size(local_app_data))
+      return nullptr;
+
+    std::wstring path{ local_app_data, length };
+    path += L"\\OpenHashTab";
+    CreateDirectoryW(path.c_str(), nullptr); // fails if it's there already, which is fine
+    path += L"\\HashCache-v" + std::to_wstring(k_version) + L".bin";
+
+    constexpr static DWORD share_all = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+
+    auto created = false;
+    const auto open = [&](DWORD share)
+    {
+      const auto handle = CreateFileW(
+        path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        share,
+        nullptr,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr
+      );
+      created = handle != INVALID_HANDLE_VALUE && GetLastError() != ERROR_ALREADY_EXISTS;
+      return handle;
+    };
+
+    // Whoever has it to themselves is only cleaning up, it's worth waiting a little for them
+    const auto open_shared = [&]
+    {
+      auto handle = open(share_all);
+      for (auto i = 0u; handle == INVALID_HANDLE_VALUE && GetLastError() == ERROR_SHARING_VIOLATION && i < k_open_retries; ++i)
+      {
+        Sleep(10);
+        handle = open(share_all);
+      }
+      return handle;
+    };
+
+    // If we can have it all to ourselves nobody else is using it, and entries left odd by a writer that died are ours
+    // to clean up
+    auto file = open(0);
+    const auto exclusive = file != INVALID_HANDLE_VALUE;
+    if (!exclusive && GetLastError() == ERROR_SHARING_VIOLATION)
+      file = open_shared();
+    if (file == INVALID_HANDLE_VALUE)
+      return nullptr;
+
+    // A new file is grown to full size by the mapping. Sparse, so the entries never written take no space on disk.
+    if (created)
+    {
+      DWORD returned;
+      DeviceIoControl(file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+    }
+
+    const auto mapping = CreateFileMappingW(
+      file,
+      nullptr,
+      PAGE_READWRITE,
+      static_cast<DWORD>(static_cast<uint64_t>(k_file_size) >> 32),
+      static_cast<DWORD>(k_file_size),
+      nullptr
+    );
+    const auto view = mapping
+      ? static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, k_file_size))
+      : nullptr;
+    if (mapping)
+      CloseHandle(mapping);
+    if (!view)
+    {
+      CloseHandle(file);
+      return nullptr;
+    }
+
+    // Whoever gets here first on a zeroed file claims it. Anything else there isn't ours to touch.
+    const auto header = reinterpret_cast<Header*>(view);
+    const auto magic = InterlockedCompareExchange(&header->magic, k_magic, 0);
+    if (magic != 0 && magic != k_magic)
+    {
+      UnmapViewOfFile(view);
+      CloseHandle(file);
+      return nullptr;
+    }
+
+    if (exclusive)
+    {
+      RecoverAbandoned(reinterpret_cast<Entry*>(view + sizeof(Header)));
+
+      // Let everyone else in again. We haven't written anything yet, so someone getting it to themselves in between
+      // has nothing of ours to clean up.
+      CloseHandle(file);
+      file = open_shared();
+      if (file == INVALID_HANDLE_VALUE)
+      {
+        UnmapViewOfFile(view);
+        return nullptr;
+      }
+    }
+
+    // The handle is never closed. The view doesn't count as having the file open, without the handle the next
+    // process would think it's alone and clean up entries we're in the middle of writing.
+    return new HashCache(view);
+  }();
+  return cache;
+}
+
+void HashCache::RecoverAbandoned(Entry* entries)
+{
+  for (auto i = 0u; i < k_entry_count; ++i)
+  {
+    auto& entry = entries[i];
+    const auto sequence = ReadNoFence(&entry.sequence);
+    if (!(sequence & 1))
+      continue;
+    // Half written, whatever is in it can't be trusted
+    entry.digest_size = 0;
+    InterlockedExchange(&entry.sequence, sequence + 1);
+  }
+}
+
+size_t HashCache::Bucket(const Key& key, uint32_t algorithm)
+{
+  // Everything that tells files apart, mixed well enough for the low bits to spread
+  auto h = key.file_id[0] ^ (key.file_id[1] * 0x9E3779B97F4A7C15) ^ (key.volume_serial << 8 | algorithm);
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCD;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53;
+  h ^= h >> 33;
+  return static_cast<size_t>(h);
+}
+
+bool HashCache::IsSameFile(const Entry& entry, const Key& key, uint32_t algorithm)
+{
+  return entry.digest_size != 0
+    && entry.volume_serial == key.volume_serial
+    && entry.file_id[0] == key.file_id[0]
+    && entry.file_id[1] == key.file_id[1]
+    && entry.algorithm == algorithm;
+}
+
+bool HashCache::Read(const Entry& entry, Entry& copy)
+{
+  const auto before = ReadAcquire(&entry.sequence);
+  if (before & 1)
+    return false;
+  memcpy(&copy, &entry, sizeof(copy));
+  MemoryBarrier();
+  return ReadNoFence(&entry.sequence) == before;
+}
+
+bool HashCache::Lookup(const Key& key, uint32_t algorithm, HashDigest& digest) const
+{
+  // Entries of the same file always go in the same probe run, it's keyed by identity only
+  const auto first = Bucket(key, algorithm);
+  for (auto i = 0u; i < k_probe_length; ++i)
+  {
+    Entry entry;
+    if (!Read(_entries[(first + i) % k_entry_count], entry) || !IsSameFile(entry, key, algorithm))
+      continue;
+
+    // Changed since, the entry will be replaced once it's hashed again
+    if (entry.size != key.size || entry.last_write_time != key.last_write_time || entry.change_time != key.change_time)
+      return false;
+
+    if (entry.digest_size > HashDigest::k_capacity)
+      return false;
+
+    digest = HashDigest{ entry.digest, entry.digest_size };
+    return true;
+  }
+  return false;
+}
+
+void HashCache::Store(const Key& key, uint32_t algorithm, const HashDigest& digest)
+{
+  // The old entry of the file if it has one, otherwise the first free one. If the run is full, a victim picked
+  // by the upper bits of the hash, they aren't used for anything else.
+  const auto first = Bucket(key, algorithm);
+  auto slot = k_probe_length;
+  for (auto i = 0u; i < k_probe_length; ++i)
+  {
+    Entry entry;
+    if (!Read(_entries[(first + i) % k_entry_count], entry))
+      continue;
+    if (IsSameFile(entry, key, algorithm))
+    {
+      slot = i;
+      break;
+    }
+    if (entry.digest_size == 0 && slot == k_probe_length)
+      slot = i;
+  }
+  if (slot == k_probe_length)
+    slot = static_cast<size_t>((static_cast<uint64_t>(first) >> 48) % k_probe_length);
+
+  auto& entry = _entries[(first + slot) % k_entry_count];
+  const auto sequence = ReadAcquire(&entry.sequence);
+  // Someone else is writing it right now, their digest is as good as ours
+  if (sequence & 1 || InterlockedCompareExchange(&entry.sequence, sequence + 1, sequence) != sequence)
+    return;
+
+  entry.volume_serial = key.volume_serial;
+  entry.file_id[0] = key.file_id[0];
+  entry.file_id[1] = key.file_id[1];
+  entry.size = key.size;
+  entry.last_write_time = key.last_write_time;
+  entry.change_time = key.change_time;
+  entry.algorithm = static_cast<uint8_t>(algorithm);
+  entry.digest_size = static_cast<uint8_t>(digest.size());
+  memcpy(entry.digest, digest.data(), digest.size());
+
+  InterlockedExchange(&entry.sequence, sequence + 2);
+}
@@ -0,0 +1,108 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+#include "../Algorithms/Hasher.h"
+
+#include <cstdint>
+
+// Digests of files hashed before, so unchanged files don't have to be read again. Lives in a memory mapped file under
+// %LOCALAPPDATA%, shared by every process using it. Entries are keyed by the file's identity and the metadata that
+// changes along with its contents, so a file that was written to just doesn't find its old entries anymore.
+//
+// The file is a fixed size, open addressed table of fixed size entries. Each entry has a sequence number that's odd
+// while it's being written. Readers copy the entry and check the sequence didn't move, writers claim it with a
+// compare and swap and leave it alone if someone else is already at it. Nobody ever waits for anyone. A writer that
+// died halfway leaves its entry odd, those are cleared by the next process to open the file while no one else has it.
+class HashCache
+{
+public:
+  // Only files whose id stays put and tells them apart qualify, see FileHashTask::LookupCache()
+  struct Key
+  {
+    uint64_t file_id[2]; // FILE_ID_INFO, or the file index in the low half where that's not available
+    uint64_t volume_serial;
+    uint64_t size;
+    uint64_t last_write_time;
+    uint64_t change_time;
+  };
+
+  // Opened on first use, null if the cache file couldn't be opened or created. Never freed.
+  static HashCache* Get();
+
+  // algorithm is the index in HashAlgorithm::g_hashers
+  bool Lookup(const Key& key, uint32_t algorithm, HashDigest& digest) const;
+
+  void Store(const Key& key, uint32_t algorithm, const HashDigest& digest);
+
+  ~HashCache() = delete;
+
+  HashCache(const HashCache&) = delete;
+  HashCache(HashCache&&) = delete;
+  HashCache& operator=(const HashCache&) = delete;
+  HashCache& operator=(HashCache&&) = delete;
+
+private:
+  // Part of the file name, bump it when the layout or the order of HashAlgorithm::g_hashers changes
+  constexpr static auto k_version = 1;
+  constexpr static LONG k_magic = 0x4354484F; // "OHTC"
+
+  constexpr static size_t k_entry_count = 1 << 18; // about 30 MB
+  constexpr static size_t k_probe_length = 8;
+
+  // How many times opening the file is tried while someone else has it to themselves
+  constexpr static unsigned k_open_retries = 20;
+
+  struct Header
+  {
+    LONG magic;
+    uint8_t reserved[60];
+  };
+
+  struct Entry
+  {
+    LONG sequence;
+    uint8_t algorithm;
+    uint8_t digest_size; // 0 for an empty entry
+    uint8_t reserved[2];
+    uint64_t volume_serial;
+    uint64_t file_id[2];
+    uint64_t size;
+    uint64_t last_write_time;
+    uint64_t change_time;
+    uint8_t digest[HashDigest::k_capacity];
+  };
+
+  static_assert(sizeof(Header) == 64, "entries should stay aligned");
+  static_assert(sizeof(Entry) == 120, "the file layout changed, bump k_version");
+
+  constexpr static size_t k_file_size = sizeof(Header) + k_entry_count * sizeof(Entry);
+
+  explicit HashCache(uint8_t* view) : _entries{ reinterpret_cast<Entry*>(view + sizeof(Header)) } {}
+
+  // Clears entries whose writer never finished. Only while we're the only one with the file open.
+  static void RecoverAbandoned(Entry* entries);
+
+  static size_t Bucket(const Key& key, uint32_t algorithm);
+
+  // Same file and algorithm, maybe from before it was changed
+  static bool IsSameFile(const Entry& entry, const Key& key, uint32_t algorithm);
+
+  // Consistent copy of the entry, false if it's being written
+  static bool Read(const Entry& entry, Entry& copy);
+
+  Entry* _entries;
+};
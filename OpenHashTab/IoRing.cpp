@@ -0,0 +1,259 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#include "stdafx.h"
+
+#include "IoRing.h"
+
+namespace
+{
+  // ioringapi.h only declares these for NTDDI_WIN10_CO and up, but we target 7
+  enum xIORING_VERSION : INT32
+  {
+    xIORING_VERSION_1 = 1
+  };
+
+  enum xIORING_REF_KIND : INT32
+  {
+    xIORING_REF_RAW = 0,
+    xIORING_REF_REGISTERED = 1
+  };
+
+  struct xIORING_CREATE_FLAGS
+  {
+    INT32 Required;
+    INT32 Advisory;
+  };
+
+  struct xIORING_REGISTERED_BUFFER
+  {
+    UINT32 BufferIndex;
+    UINT32 Offset;
+  };
+
+  struct xIORING_HANDLE_REF
+  {
+    xIORING_REF_KIND Kind;
+    union
+    {
+      HANDLE Handle;
+      UINT32 Index;
+    } Handle;
+  };
+
+  struct xIORING_BUFFER_REF
+  {
+    xIORING_REF_KIND Kind;
+    union
+    {
+      void* Address;
+      xIORING_REGISTERED_BUFFER IndexAndOffset;
+    } Buffer;
+  };
+
+  struct xIORING_CQE
+  {
+    UINT_PTR UserData;
+    HRESULT ResultCode;
+    ULONG_PTR Information;
+  };
+
+  constexpr static HRESULT xIORING_E_SUBMISSION_QUEUE_FULL = static_cast<HRESULT>(0x80460002L);
+
+  DWORD ErrorFromHresult(HRESULT hr)
+  {
+    // Nothing wrong with the file, the ring is just full. Callers retry those once some reads have completed.
+    if (hr == xIORING_E_SUBMISSION_QUEUE_FULL)
+      return ERROR_NOT_ENOUGH_MEMORY;
+    if (hr & FACILITY_NT_BIT)
+      return RtlNtStatusToDosError(static_cast<NTSTATUS>(hr & ~FACILITY_NT_BIT));
+    if (HRESULT_FACILITY(hr) == FACILITY_WIN32)
+      return HRESULT_CODE(hr);
+    return ERROR_READ_FAULT;
+  }
+}
+
+struct IoRingReader::Api
+{
+  HRESULT (WINAPI* CreateIoRing)(xIORING_VERSION, xIORING_CREATE_FLAGS, UINT32, UINT32, HANDLE*);
+  HRESULT (WINAPI* CloseIoRing)(HANDLE);
+  HRESULT (WINAPI* SubmitIoRing)(HANDLE, UINT32, UINT32, UINT32*);
+  HRESULT (WINAPI* PopIoRingCompletion)(HANDLE, xIORING_CQE*);
+  HRESULT (WINAPI* SetIoRingCompletionEvent)(HANDLE, HANDLE);
+  HRESULT (WINAPI* BuildIoRingReadFile)(HANDLE, xIORING_HANDLE_REF, xIORING_BUFFER_REF, UINT32, UINT64, UINT_PTR, INT32);
+};
+
+const IoRingReader::Api* IoRingReader::LoadApi()
+{
+  static const auto api = []() -> const Api*
+  {
+    static Api fns{};
+    const auto kernelbase = GetModuleHandleW(L"kernelbase");
+    if (!kernelbase)
+      return nullptr;
+
+#define FN(name) fns.name = reinterpret_cast<decltype(fns.name)>(GetProcAddress(kernelbase, #name)); if (!fns.name) return nullptr
+
+    FN(CreateIoRing);
+    FN(CloseIoRing);
+    FN(SubmitIoRing);
+    FN(PopIoRingCompletion);
+    FN(SetIoRingCompletionEvent);
+    FN(BuildIoRingReadFile);
+
+#undef FN
+
+    return &fns;
+  }();
+  return api;
+}
+
+IoRingReader* IoRingReader::Create(CompletionFn* completion)
+{
+  const auto reader = new IoRingReader();
+  if (reader->Init(completion))
+    return reader;
+  delete reader;
+  return nullptr;
+}
+
+bool IoRingReader::Init(CompletionFn* completion)
+{
+  _api = LoadApi();
+  if (!_api)
+    return false;
+
+  _completion = completion;
+
+  HANDLE ring{};
+  if (FAILED(_api->CreateIoRing(xIORING_VERSION_1, {}, k_submission_queue_size, k_completion_queue_size, &ring)))
+    return false;
+  _ring = ring;
+
+  _event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+  if (!_event)
+    return false;
+
+  if (FAILED(_api->SetIoRingCompletionEvent(_ring, _event)))
+    return false;
+
+  _wait = CreateThreadpoolWait(WaitCallback, this, nullptr);
+  if (!_wait)
+    return false;
+
+  SetThreadpoolWait(_wait, _event, nullptr);
+  return true;
+}
+
+IoRingReader::~IoRingReader()
+{
+  if (_wait)
+  {
+    SetThreadpoolWait(_wait, nullptr, nullptr);
+    WaitForThreadpoolWaitCallbacks(_wait, TRUE);
+    CloseThreadpoolWait(_wait);
+  }
+  if (_ring)
+    _api->CloseIoRing(_ring);
+  if (_event)
+    CloseHandle(_event);
+}
+
+VOID NTAPI IoRingReader::WaitCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx,
+  _Inout_     PTP_WAIT              wait,
+  _In_        TP_WAIT_RESULT        wait_result
+)
+{
+  UNREFERENCED_PARAMETER(instance);
+  UNREFERENCED_PARAMETER(wait_result);
+  const auto reader = static_cast<IoRingReader*>(ctx);
+  // Rearm before popping, so anything completing after our last pop signals again
+  SetThreadpoolWait(wait, reader->_event, nullptr);
+  reader->DispatchCompletions();
+}
+
+void IoRingReader::DispatchCompletions()
+{
+  constexpr static auto k_batch = 64u;
+  xIORING_CQE cqes[k_batch];
+  auto count = 0u;
+  do
+  {
+    count = 0;
+    AcquireSRWLockExclusive(&_lock);
+    while (count < k_batch && _api->PopIoRingCompletion(_ring, &cqes[count]) == S_OK)
+      ++count;
+    ReleaseSRWLockExclusive(&_lock);
+
+    // Not under the lock, completions usually queue the next read
+    for (auto i = 0u; i < count; ++i)
+    {
+      const auto& cqe = cqes[i];
+      const auto error = SUCCEEDED(cqe.ResultCode) ? ERROR_SUCCESS : ErrorFromHresult(cqe.ResultCode);
+      _completion(reinterpret_cast<void*>(cqe.UserData), error, cqe.Information);
+    }
+  }
+  while (count == k_batch);
+}
+
+void IoRingReader::SubmitLocked()
+{
+  UINT32 submitted{};
+  // If this fails the entries stay queued and go with the next submit
+  if (SUCCEEDED(_api->SubmitIoRing(_ring, 0, 0, &submitted)))
+    _unsubmitted = false;
+}
+
+DWORD IoRingReader::Read(HANDLE file, void* buffer, DWORD size, uint64_t offset, void* user_data, bool submit)
+{
+  xIORING_HANDLE_REF file_ref{ xIORING_REF_RAW };
+  file_ref.Handle.Handle = file;
+  xIORING_BUFFER_REF buffer_ref{ xIORING_REF_RAW };
+  buffer_ref.Buffer.Address = buffer;
+
+  const auto build = [&]
+  {
+    return _api->BuildIoRingReadFile(_ring, file_ref, buffer_ref, size, offset, reinterpret_cast<UINT_PTR>(user_data), 0);
+  };
+
+  AcquireSRWLockExclusive(&_lock);
+  auto hr = build();
+  if (hr == xIORING_E_SUBMISSION_QUEUE_FULL)
+  {
+    // Make room by sending off what's queued so far. If the submit failed too it's still full, and the read is
+    // turned away as if we were out of memory.
+    SubmitLocked();
+    hr = build();
+  }
+  if (SUCCEEDED(hr))
+  {
+    _unsubmitted = true;
+    if (submit)
+      SubmitLocked();
+  }
+  ReleaseSRWLockExclusive(&_lock);
+
+  return SUCCEEDED(hr) ? ERROR_SUCCESS : ErrorFromHresult(hr);
+}
+
+void IoRingReader::Submit()
+{
+  AcquireSRWLockExclusive(&_lock);
+  if (_unsubmitted)
+    SubmitLocked();
+  ReleaseSRWLockExclusive(&_lock);
+}
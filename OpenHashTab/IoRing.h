@@ -0,0 +1,75 @@
+//    Copyright 2019-2020 namazso <admin@namazso.eu>
+//    This file is part of OpenHashTab.
+//
+//    OpenHashTab is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    OpenHashTab is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with OpenHashTab.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// Reads through the I/O ring API of Windows 11, resolved at runtime so we still load on older systems. A single ring
+// is shared by all files, with reads queued from any thread and completions delivered on the threadpool, the same
+// way PTP_IO does it for overlapped reads.
+class IoRingReader
+{
+public:
+  using CompletionFn = void(void* user_data, DWORD error, size_t bytes_transferred);
+
+  // The completion queue has to hold a completion for every read in flight, that's at most one per block
+  constexpr static UINT32 k_submission_queue_size = 256;
+  constexpr static UINT32 k_completion_queue_size = 1024;
+
+private:
+  struct Api;
+
+  const Api* _api{};
+  HANDLE _ring{};
+  HANDLE _event{};
+  PTP_WAIT _wait{};
+  CompletionFn* _completion{};
+  SRWLOCK _lock = SRWLOCK_INIT;
+  bool _unsubmitted{};
+
+  static VOID NTAPI WaitCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx,
+    _Inout_     PTP_WAIT              wait,
+    _In_        TP_WAIT_RESULT        wait_result
+  );
+
+  IoRingReader() = default;
+
+  static const Api* LoadApi();
+
+  bool Init(CompletionFn* completion);
+
+  void DispatchCompletions();
+
+  // Call with _lock held
+  void SubmitLocked();
+
+public:
+  IoRingReader(const IoRingReader&) = delete;
+  IoRingReader(IoRingReader&&) = delete;
+  IoRingReader& operator=(const IoRingReader&) = delete;
+  IoRingReader& operator=(IoRingReader&&) = delete;
+  ~IoRingReader();
+
+  // Returns nullptr if I/O rings aren't available
+  static IoRingReader* Create(CompletionFn* completion);
+
+  // Queue a read of size bytes at offset. Unless submit is set it's only handed to the kernel by the next Submit(),
+  // so a batch of reads costs a single call. Returns a Win32 error code, ERROR_NOT_ENOUGH_MEMORY if the ring has no
+  // room for it right now and it should be tried again later.
+  DWORD Read(HANDLE file, void* buffer, DWORD size, uint64_t offset, void* user_data, bool submit = true);
+
+  void Submit();
+};
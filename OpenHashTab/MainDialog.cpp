@@ -430,7 +430,10 @@ INT_PTR MainDialog::OnFileFinished(UINT, WPARAM, LPARAM lparam)
       {
         wchar_t hash_str[HashAlgorithm::k_max_size * 2 + 1];
         utl::HashBytesToString(hash_str, result, _prop_page->settings.display_uppercase);
-        const auto tname = utl::UTF8ToWide(HashAlgorithm::g_hashers[i].GetName());
+        auto tname = utl::UTF8ToWide(HashAlgorithm::g_hashers[i].GetName());
+        // Not read this time, make sure nobody takes it for a fresh hash
+        if (file->IsFromCache())
+          tname += L" " + utl::GetString(IDS_FROM_CACHE);
         AddItemToFileList(file->GetDisplayName().c_str(), tname.c_str(), hash_str, file->ToLparam(i));
       }
     }
@@ -624,6 +627,8 @@ INT_PTR MainDialog::OnHashEditChanged(UINT, WPARAM, LPARAM)
   auto found = false;
   for (const auto& file : _prop_page->GetFiles())
   {
+    if (file->GetError())
+      continue;
     const auto& result = file->GetHashResult();
     for (auto i = 0; i < HashAlgorithm::k_count; ++i)
     {
@@ -17,4 +17,370 @@
 
 #include "Queues.h"
 
-moodycamel::ConcurrentQueue<FileHashTask*> g_read_queue;
\ No newline at end of file
+#include "FileHashTask.h"
+#include "utl.h"
+
+#include <winioctl.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+moodycamel::ConcurrentQueue<FileHashTask*> g_read_queue;
+
+namespace
+{
+  // Windows 8 and up, winioctl.h only declares these for newer targets
+  constexpr static auto xStorageDeviceSeekPenaltyProperty = static_cast<STORAGE_PROPERTY_ID>(7);
+
+  struct xDEVICE_SEEK_PENALTY_DESCRIPTOR
+  {
+    DWORD Version;
+    DWORD Size;
+    BOOLEAN IncursSeekPenalty;
+  };
+}
+
+DeviceQueue::Kind DeviceQueue::Probe(const std::wstring& path)
+{
+  wchar_t mount_point[MAX_PATH];
+  if (!GetVolumePathNameW(path.c_str(), mount_point, static_cast<DWORD>(std::size(mount_point))))
+    return Kind::Unknown;
+
+  wchar_t volume_name[MAX_PATH];
+  if (!GetVolumeNameForVolumeMountPointW(mount_point, volume_name, static_cast<DWORD>(std::size(volume_name))))
+    return Kind::Unknown; // network shares end up here
+
+  // The volume itself is opened without the trailing backslash, and no access is needed for querying properties
+  const auto length = wcslen(volume_name);
+  if (length && volume_name[length - 1] == L'\\')
+    volume_name[length - 1] = 0;
+
+  const auto volume = CreateFileW(
+    volume_name,
+    0,
+    FILE_SHARE_READ | FILE_SHARE_WRITE,
+    nullptr,
+    OPEN_EXISTING,
+    0,
+    nullptr
+  );
+
+  if (volume == INVALID_HANDLE_VALUE)
+    return Kind::Unknown;
+
+  STORAGE_PROPERTY_QUERY query{};
+  query.PropertyId = xStorageDeviceSeekPenaltyProperty;
+  query.QueryType = PropertyStandardQuery;
+
+  xDEVICE_SEEK_PENALTY_DESCRIPTOR desc{};
+  DWORD returned{};
+  const auto success = DeviceIoControl(
+    volume,
+    IOCTL_STORAGE_QUERY_PROPERTY,
+    &query,
+    sizeof(query),
+    &desc,
+    sizeof(desc),
+    &returned,
+    nullptr
+  );
+
+  CloseHandle(volume);
+
+  // Fails on 7, and for volumes spanning multiple disks
+  if (!success || returned < sizeof(desc))
+    return Kind::Unknown;
+
+  return desc.IncursSeekPenalty ? Kind::Rotational : Kind::SolidState;
+}
+
+uint64_t DeviceQueue::LayoutKey(HANDLE file, uint64_t file_index)
+{
+  // Record number is the low 48 bits, the rest is a sequence number we don't want to sort by
+  const auto fallback = file_index & 0x0000FFFFFFFFFFFF;
+
+  // The handle is overlapped, so even this needs an OVERLAPPED to wait on
+  OVERLAPPED overlapped{};
+  overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+  if (!overlapped.hEvent)
+    return fallback;
+
+  STARTING_VCN_INPUT_BUFFER input{};
+  RETRIEVAL_POINTERS_BUFFER output{};
+  DWORD returned{};
+  auto success = DeviceIoControl(
+    file,
+    FSCTL_GET_RETRIEVAL_POINTERS,
+    &input,
+    sizeof(input),
+    &output,
+    sizeof(output),
+    &returned,
+    &overlapped
+  );
+  if (!success && GetLastError() == ERROR_IO_PENDING)
+    success = GetOverlappedResult(file, &overlapped, &returned, TRUE);
+
+  // We only asked for room for the first extent, the rest doesn't matter
+  const auto error = success ? ERROR_SUCCESS : GetLastError();
+  CloseHandle(overlapped.hEvent);
+
+  if (error != ERROR_SUCCESS && error != ERROR_MORE_DATA)
+    return fallback;
+  if (output.ExtentCount == 0 || output.Extents[0].Lcn.QuadPart < 0) // -1 is a sparse or compressed hole
+    return fallback;
+
+  // Files with extents sort after the resident ones, by their first cluster
+  return 1ull << 63 | static_cast<uint64_t>(output.Extents[0].Lcn.QuadPart);
+}
+
+DeviceQueue* DeviceQueue::ForVolume(uint32_t volume_serial, const std::wstring& path)
+{
+  static std::mutex mutex;
+  static std::unordered_map<uint32_t, std::unique_ptr<DeviceQueue>> queues;
+
+  std::lock_guard<std::mutex> lock{ mutex };
+  auto& queue = queues[volume_serial];
+  if (!queue)
+  {
+    const auto kind = Probe(path);
+    DebugMsg("DeviceQueue: volume %08X kind %d\n", volume_serial, static_cast<int>(kind));
+    queue.reset(new DeviceQueue(kind));
+  }
+  return queue.get();
+}
+
+DeviceQueue::DeviceQueue(Kind kind)
+  : _kind(kind)
+{
+  switch (kind)
+  {
+  case Kind::Rotational:
+    _limit = 1;
+    break;
+  case Kind::SolidState:
+    _limit = k_solid_state_initial_limit;
+    break;
+  default:
+    _limit = k_unknown_limit;
+    break;
+  }
+}
+
+FileHashTask* DeviceQueue::TakeNext(std::multimap<uint64_t, FileHashTask*>& waiting, uint64_t& head)
+{
+  // Continue the sweep from where the last file was, or start over from the beginning
+  auto it = waiting.lower_bound(head);
+  if (it == waiting.end())
+    it = waiting.begin();
+  head = it->first;
+  const auto file = it->second;
+  waiting.erase(it);
+  if (file->IsWaitingOnDevice())
+  {
+    file->SetWaitingOnDevice(false);
+    --_uncounted;
+  }
+  return file;
+}
+
+void DeviceQueue::LeaveWaiting(FileHashTask* file)
+{
+  if (_uncounted >= k_max_uncounted)
+    return;
+  ++_uncounted;
+  file->SetWaitingOnDevice(true);
+}
+
+bool DeviceQueue::WantsSmallDrainer() const
+{
+  return !_small_waiting.empty()
+    && _small_drainers < k_small_max_drainers
+    && _small_waiting.size() > _small_drainers * k_small_backlog;
+}
+
+size_t DeviceQueue::TakeStartable(FileHashTask** files, size_t max_count, unsigned& small_drainers)
+{
+  auto count = 0u;
+  small_drainers = 0;
+  while (_active < _limit)
+  {
+    // A batch gets many results out in the time of a single big file
+    if (WantsSmallDrainer())
+    {
+      ++_small_drainers;
+      ++small_drainers;
+    }
+    else if (count < max_count && !_waiting.empty())
+      files[count++] = TakeNext(_waiting, _head);
+    else
+      break;
+    ++_active;
+  }
+  return count;
+}
+
+void DeviceQueue::StartDrainers(unsigned count)
+{
+  for (auto i = 0u; i < count; ++i)
+    if (!TrySubmitThreadpoolCallback(FileHashTask::SmallFileDrainCallback, this, nullptr))
+      FileHashTask::DrainSmallFiles(this);
+}
+
+void DeviceQueue::Enqueue(FileHashTask* file)
+{
+  FileHashTask* start[1];
+  unsigned drainers;
+
+  AcquireSRWLockExclusive(&_lock);
+  // Don't count the time we had nothing to read as slow
+  if (_active == 0)
+  {
+    _window_start = GetTickCount64();
+    _window_bytes = _bytes_read;
+  }
+  _waiting.emplace(file->GetLayoutKey(), file);
+  const auto count = TakeStartable(start, std::size(start), drainers);
+  if (count == 0 || start[0] != file)
+    LeaveWaiting(file);
+  ReleaseSRWLockExclusive(&_lock);
+
+  StartDrainers(drainers);
+  if (count)
+    start[0]->StartReading();
+}
+
+void DeviceQueue::EnqueueSmall(FileHashTask* file)
+{
+  FileHashTask* start[1];
+  unsigned drainers;
+
+  AcquireSRWLockExclusive(&_lock);
+  if (_active == 0)
+  {
+    _window_start = GetTickCount64();
+    _window_bytes = _bytes_read;
+  }
+  _small_waiting.emplace(file->GetLayoutKey(), file);
+  const auto count = TakeStartable(start, std::size(start), drainers);
+  // Even with a drainer just started for it, it's still waiting until the drainer takes it
+  LeaveWaiting(file);
+  ReleaseSRWLockExclusive(&_lock);
+
+  StartDrainers(drainers);
+  if (count)
+    start[0]->StartReading();
+}
+
+size_t DeviceQueue::TakeSmallBatch(FileHashTask** files, size_t max_count)
+{
+  FileHashTask* start[k_solid_state_max_limit];
+  auto start_count = size_t{};
+  unsigned drainers{};
+
+  AcquireSRWLockExclusive(&_lock);
+  // Every read of a batch is in flight at once, on a disk that's one file at a time in the order they lie in
+  max_count = std::min<size_t>(max_count, _limit);
+  auto count = size_t{};
+  while (count < max_count && !_small_waiting.empty())
+    files[count++] = TakeNext(_small_waiting, _small_head);
+  if (count == 0)
+  {
+    // Nothing was added since we last looked, anything added later sees we're gone
+    --_small_drainers;
+    --_active;
+    start_count = TakeStartable(start, std::size(start), drainers);
+  }
+  ReleaseSRWLockExclusive(&_lock);
+
+  StartDrainers(drainers);
+  for (auto i = 0u; i < start_count; ++i)
+    start[i]->StartReading();
+  return count;
+}
+
+VOID NTAPI DeviceQueue::StartCallback(
+  _Inout_     PTP_CALLBACK_INSTANCE instance,
+  _Inout_opt_ PVOID                 ctx
+)
+{
+  UNREFERENCED_PARAMETER(instance);
+  static_cast<FileHashTask*>(ctx)->StartReading();
+}
+
+void DeviceQueue::Release()
+{
+  FileHashTask* start[1];
+  unsigned drainers;
+
+  AcquireSRWLockExclusive(&_lock);
+  --_active;
+  const auto count = TakeStartable(start, std::size(start), drainers);
+  ReleaseSRWLockExclusive(&_lock);
+
+  StartDrainers(drainers);
+
+  // We are called from a finishing file, and the next one might finish right away too (cancelled, say). Starting it on
+  // a fresh stack keeps a long queue of those from recursing.
+  if (count && !TrySubmitThreadpoolCallback(StartCallback, start[0], nullptr))
+    start[0]->StartReading();
+}
+
+void DeviceQueue::AddBytesRead(uint64_t bytes)
+{
+  _bytes_read += bytes;
+
+  if (_kind != Kind::SolidState)
+    return;
+
+  const auto now = GetTickCount64();
+  if (now - _window_start < k_adapt_interval_ms)
+    return;
+
+  // Someone else is already on it
+  if (!TryAcquireSRWLockExclusive(&_lock))
+    return;
+
+  FileHashTask* start[k_solid_state_max_limit];
+  auto count = size_t{};
+  unsigned drainers{};
+  if (now - _window_start >= k_adapt_interval_ms)
+  {
+    Adapt(now);
+    count = TakeStartable(start, std::size(start), drainers);
+  }
+  ReleaseSRWLockExclusive(&_lock);
+
+  StartDrainers(drainers);
+
+  for (auto i = 0u; i < count; ++i)
+    start[i]->StartReading();
+}
+
+void DeviceQueue::Adapt(uint64_t now)
+{
+  const auto bytes = _bytes_read.load();
+  const auto throughput = (bytes - _window_bytes) / (now - _window_start);
+  _window_start = now;
+  _window_bytes = bytes;
+
+  // Nothing waiting means the limit isn't what's holding us back, so what we measured says nothing about it
+  if (_waiting.empty() && _active < _limit)
+    return;
+
+  // Within a few percent is noise, otherwise turn around if it got worse
+  if (throughput < _last_throughput - _last_throughput / 16)
+    _direction = -_direction;
+  _last_throughput = throughput;
+
+  const auto limit = static_cast<int>(_limit) + _direction;
+  _limit = static_cast<unsigned>(std::clamp<int>(
+    limit,
+    k_solid_state_min_limit,
+    k_solid_state_max_limit
+  ));
+
+  DebugMsg("DeviceQueue: %llu bytes/ms, limit %u\n", throughput, _limit);
+}
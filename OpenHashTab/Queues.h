@@ -17,6 +17,119 @@
 
 #include <blockingconcurrentqueue.h>
 
+#include <atomic>
+#include <map>
+#include <string>
+
 class FileHashTask;
 
-extern moodycamel::ConcurrentQueue<FileHashTask*> g_read_queue;
\ No newline at end of file
+extern moodycamel::ConcurrentQueue<FileHashTask*> g_read_queue;
+
+// Limits how many files are read from one device at once, so files on a slow device only ever wait for each other.
+// Rotational disks get a single file at a time, seeking between files only costs throughput. Solid state devices
+// start with a few and adjust the limit to whatever gets the most throughput.
+// Waiting files are started in the order of their layout key, sweeping across the disk like an elevator.
+// Small files wait in a queue of their own and are read in batches, see FileHashTask::DrainSmallFiles(). A drainer
+// takes one slot of the limit for as long as it runs, so they wait for big files on the same device and vice versa.
+class DeviceQueue
+{
+public:
+  enum class Kind
+  {
+    Unknown,
+    Rotational,
+    SolidState
+  };
+
+  // Shared by all files with this volume serial, lives as long as the process. The first file probes the device.
+  static DeviceQueue* ForVolume(uint32_t volume_serial, const std::wstring& path);
+
+  // Starts the file right away, or once a file before it on the same device is done
+  void Enqueue(FileHashTask* file);
+
+  // Small file counterpart of Enqueue(), the file is read by a drainer in one of its batches
+  void EnqueueSmall(FileHashTask* file);
+
+  // Next batch for a drainer, in layout order and no more files than the limit allows reads in flight. Returns 0
+  // once there's nothing left, the drainer's slot is given back then and it has to stop.
+  size_t TakeSmallBatch(FileHashTask** files, size_t max_count);
+
+  Kind GetKind() const { return _kind; }
+
+  // Where the file is on the disk, for ordering reads: the first cluster of its data, or for files without any
+  // (small ones stored in the MFT record, or when the file system can't tell) the MFT record number.
+  // Expects a handle that isn't bound to a completion port yet.
+  static uint64_t LayoutKey(HANDLE file, uint64_t file_index);
+
+  // A file started by this queue is done
+  void Release();
+
+  // Completed reads, for measuring throughput
+  void AddBytesRead(uint64_t bytes);
+
+  DeviceQueue(const DeviceQueue&) = delete;
+  DeviceQueue(DeviceQueue&&) = delete;
+  DeviceQueue& operator=(const DeviceQueue&) = delete;
+  DeviceQueue& operator=(DeviceQueue&&) = delete;
+
+private:
+  constexpr static unsigned k_unknown_limit = 2;
+  constexpr static unsigned k_solid_state_initial_limit = 4;
+  constexpr static unsigned k_solid_state_min_limit = 2;
+  constexpr static unsigned k_solid_state_max_limit = 16;
+
+  // One drainer picks up everything queued while it was busy. More only join once this many files wait for each.
+  constexpr static unsigned k_small_max_drainers = 4;
+  constexpr static size_t k_small_backlog = 16;
+
+  // Waiting files give their slot in the coordinator's window to files on other devices, up to this many of them.
+  // Plenty to sort by layout, but keeps a huge selection on a slow disk from being opened all at once.
+  constexpr static size_t k_max_uncounted = 1024;
+
+  // How long throughput is measured before the limit is moved
+  constexpr static uint64_t k_adapt_interval_ms = 500;
+
+  explicit DeviceQueue(Kind kind);
+
+  static Kind Probe(const std::wstring& path);
+
+  static VOID NTAPI StartCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE instance,
+    _Inout_opt_ PVOID                 ctx
+  );
+
+  // Call with _lock held. Returns the files that may start now, and how many small file drainers in small_drainers.
+  size_t TakeStartable(FileHashTask** files, size_t max_count, unsigned& small_drainers);
+
+  // Call with _lock held. Whether a slot should go to a new drainer rather than the next big file.
+  bool WantsSmallDrainer() const;
+
+  // Call with _lock held. Takes the file nearest after head, or wraps around to the first one.
+  FileHashTask* TakeNext(std::multimap<uint64_t, FileHashTask*>& waiting, uint64_t& head);
+
+  // Call with _lock held, for a file just queued that didn't start right away
+  void LeaveWaiting(FileHashTask* file);
+
+  void StartDrainers(unsigned count);
+
+  // Call with _lock held. Hill climbing on the limit: keep going in the same direction while it helps.
+  void Adapt(uint64_t now);
+
+  Kind _kind;
+
+  SRWLOCK _lock = SRWLOCK_INIT;
+  std::multimap<uint64_t, FileHashTask*> _waiting; // by layout key, equal keys stay in arrival order
+  uint64_t _head{}; // layout key of the file started last
+  std::multimap<uint64_t, FileHashTask*> _small_waiting;
+  uint64_t _small_head{};
+  unsigned _small_drainers{};
+  size_t _uncounted{}; // waiting files that gave their slot in the window away
+  unsigned _active{}; // files and small file drainers
+  unsigned _limit{};
+
+  std::atomic<uint64_t> _bytes_read{};
+  std::atomic<uint64_t> _window_start{}; // tick count
+  uint64_t _window_bytes{};
+  uint64_t _last_throughput{};
+  int _direction{ 1 };
+};
@@ -84,4 +84,15 @@ struct Settings
   RegistrySetting<bool> sumfile_banner{ "SumfileBanner", true };
   RegistrySetting<bool> sumfile_banner_date{ "SumfileBannerDate", false };
   RegistrySetting<bool> virustotal_tos{ "VTToS", false };
+  RegistrySetting<bool> fused_update{ "FusedUpdate", false };
+  RegistrySetting<DWORD> hash_threads{ "HashThreads", 0 }; // 0 for one per hardware thread
+  RegistrySetting<DWORD> block_budget_mb{ "BlockBudgetMB", 0 }; // 0 for half the available memory, up to 1 GB. At most 2 GB.
+  RegistrySetting<bool> large_pages{ "LargePages", false };
+  RegistrySetting<DWORD> read_ahead{ "ReadAhead", 2 }; // blocks read per file ahead of the one being hashed
+  RegistrySetting<bool> layout_order{ "LayoutOrder", true }; // read files on rotational disks in physical order
+  RegistrySetting<DWORD> active_files{ "ActiveFiles", 32 }; // 0 for no limit
+  RegistrySetting<DWORD> schedule_policy{ "SchedulePolicy", 2 }; // Coordinator::SchedulePolicy. CachedFirst costs a read per uncached file it checks.
+  RegistrySetting<bool> memory_mapped{ "MemoryMapped", false }; // hash local files straight from mapped views
+  RegistrySetting<DWORD> cache_policy{ "CachePolicy", 0 }; // FileHashTask::CachePolicy
+  RegistrySetting<bool> hash_cache{ "HashCache", false }; // reuse digests of files whose size and times are unchanged
 };
\ No newline at end of file
@@ -42,6 +42,7 @@ static constexpr SettingCheckbox s_boxes[] =
   { &Settings::sumfile_dot_hash_compatible, CTLSTR(SUMFILE_DOT_HASH_COMPATIBLE)  },
   { &Settings::sumfile_banner,              CTLSTR(SUMFILE_BANNER             )  },
   { &Settings::sumfile_banner_date,         CTLSTR(SUMFILE_BANNER_DATE        )  },
+  { &Settings::fused_update,                CTLSTR(FUSED_UPDATE               )  },
 };
 
 #undef CTLSTR
@@ -22,7 +22,7 @@
 
 class SumFileParser
 {
-  std::vector<uint8_t> _current_hash{};
+  HashDigest _current_hash{};
   std::string _current_filename{};
   FileSumList _files{};
 
@@ -143,11 +143,16 @@ public:
       const auto hexchar = utl::unhex(c);
       if (hexchar != 0xFF)
       {
-        _current_hash.push_back(hexchar | _half_byte);
-        if (_current_hash.size() > HashAlgorithm::k_max_size)
+        // Overlong hashes still make a valid line, they just can't match anything
+        if (!_current_hash.push_back(hexchar | _half_byte))
+        {
+          _current_hash.clear();
           _state = State::Space;
+        }
         else
+        {
           _state = State::Hash1;
+        }
       }
       else
       {
@@ -18,8 +18,9 @@
 #include <list>
 #include <string>
 #include <utility>
-#include <vector>
 
-using FileSum = std::pair<std::string, std::vector<uint8_t>>;
+#include "../Algorithms/Hasher.h"
+
+using FileSum = std::pair<std::string, HashDigest>;
 using FileSumList = std::list<FileSum>;
 DWORD TryParseSumFile(HANDLE h, FileSumList& output);
\ No newline at end of file
@@ -68,7 +68,7 @@ ProcessedFileList ProcessEverything(std::list<std::wstring> list, const Settings
   ProcessedFileList pfl;
 
   pfl.sumfile_type = -2;
-  std::list<std::pair<std::wstring, std::vector<uint8_t>>> fsl_absolute;
+  std::list<std::pair<std::wstring, HashDigest>> fsl_absolute;
 
   if (list.size() == 1)
   {
@@ -111,7 +111,7 @@ ProcessedFileList ProcessEverything(std::list<std::wstring> list, const Settings
           const auto path = sumfile_base_path + utl::UTF8ToWide(filesum.first.c_str());
 
           // absolutize paths we found in the sumfile
-          fsl_absolute.emplace_back(path, std::move(filesum.second));
+          fsl_absolute.emplace_back(path, filesum.second);
         }
 
         // fall through - let it calculate the sumfile's sum, in case the user needs that
@@ -39,7 +39,7 @@ struct ProcessedFileList
     std::wstring relative_path;
 
     // Expected hashes. We'll try to figure out which belongs to what algorithm
-    std::list<std::vector<uint8_t>> expected_hashes;
+    std::list<HashDigest> expected_hashes;
   };
 
   // Files to hash, keyed by normalized path
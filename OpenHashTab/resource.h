@@ -69,14 +69,17 @@
 #define IDS_COPY_FILE           		236
 #define IDS_COPY_EVERYTHING           	237
 #define IDS_FONT           	            238
+#define IDC_CHECK_FUSED_UPDATE          228
+#define IDS_FUSED_UPDATE                239
+#define IDS_FROM_CACHE                  240
 
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
-#define _APS_NEXT_RESOURCE_VALUE        239
+#define _APS_NEXT_RESOURCE_VALUE        241
 #define _APS_NEXT_COMMAND_VALUE         32768
-#define _APS_NEXT_CONTROL_VALUE         228
+#define _APS_NEXT_CONTROL_VALUE         229
 #define _APS_NEXT_SYMED_VALUE           111
 #endif
 #endif
@@ -129,7 +129,7 @@ std::wstring utl::MakePathLongCompatible(std::wstring file)
   return file;
 }
 
-HANDLE utl::OpenForRead(const std::wstring& file, bool async)
+HANDLE utl::OpenForRead(const std::wstring& file, bool async, DWORD flags)
 {
   return CreateFileW(
     MakePathLongCompatible(file).c_str(),
@@ -137,7 +137,7 @@ HANDLE utl::OpenForRead(const std::wstring& file, bool async)
     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
     nullptr,
     OPEN_EXISTING,
-    FILE_ATTRIBUTE_NORMAL | (async ? FILE_FLAG_OVERLAPPED : 0),
+    FILE_ATTRIBUTE_NORMAL | (async ? FILE_FLAG_OVERLAPPED : 0) | flags,
     nullptr
   );
 }
@@ -18,6 +18,8 @@
 #include <string>
 #include <vector>
 
+#include "../Algorithms/Hasher.h"
+
 #ifdef _DEBUG
 inline void DebugMsg(PCSTR fmt, ...)
 {
@@ -65,7 +67,7 @@ namespace utl
   };
 
   template <typename Char>
-  void HashBytesToString(Char* str, const std::vector<uint8_t>& hash, bool upper = true)
+  void HashBytesToString(Char* str, const HashDigest& hash, bool upper = true)
   {
     for (auto b : hash)
     {
@@ -76,7 +78,7 @@ namespace utl
   }
 
   template <typename Char>
-  std::vector<uint8_t> HashStringToBytes(Char* str)
+  HashDigest HashStringToBytes(Char* str)
   {
     auto it = str;
     do
@@ -84,7 +86,7 @@ namespace utl
         break;
     while (++it);
 
-    std::vector<uint8_t> res;
+    HashDigest res;
 
     uint8_t byte = 0;
     for (auto i = 0; it[i]; ++i)
@@ -96,8 +98,8 @@ namespace utl
       else
         if (i % 2 == 0)
           byte = nibble << 4;
-        else
-          res.push_back(byte | nibble);
+        else if (!res.push_back(byte | nibble))
+          return {}; // longer than any hash we know
 
     return res;
   }
@@ -156,7 +158,7 @@ namespace utl
 
   std::wstring MakePathLongCompatible(std::wstring file);
 
-  HANDLE OpenForRead(const std::wstring& file, bool async = false);
+  HANDLE OpenForRead(const std::wstring& file, bool async = false, DWORD flags = 0);
 
   DWORD SetClipboardText(HWND hwnd, std::wstring_view text);
 